@@ -1,22 +1,32 @@
 #version 330 core
 
 // input data : sent from main program
-layout (location = 0) in vec3 vertexPosition;
-layout (location = 1) in vec3 vertexColor;
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec4 vertexColor;       // per vertex for the HUD, per instance for everything else
+layout (location = 2) in vec4 instanceTransform; // per instance: offset x, offset y, angle (radians), scale
+layout (location = 3) in vec2 instanceFall;      // bricks only: fall distance at spawn, 1 if the brick falls
 
-uniform mat4 MVP;
+// Updated once per frame by the main program
+layout (std140) uniform Frame {
+    mat4 VP;
+    float Fall; // distance the bricks have fallen so far
+};
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    // Scale, rotate about the origin, then move to the instance's offset
+    float c = cos(instanceTransform.z), s = sin(instanceTransform.z);
+    vec2 p = instanceTransform.w * vertexPosition;
+    float y = instanceTransform.y - instanceFall.y * (Fall - instanceFall.x);
+    vec4 v = vec4(c*p.x - s*p.y + instanceTransform.x, s*p.x + c*p.y + y, 0, 1);
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
-    fragColor = vertexColor;
+    fragColor = vertexColor.rgb;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * Model * position
+    gl_Position = VP * v;
 }
@@ -2,9 +2,27 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/stat.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -21,6 +39,9 @@ struct VAO {
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int SortId;       // small unique number used in render queue sort keys
+    int Mesh;         // geometry in the mesh registry, -1 for a streamed object with its own buffers
+    GLubyte Color[4]; // colour of a registry object, sent with each instance
 };
 typedef struct VAO VAO;
 
@@ -28,9 +49,17 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLuint UniformBuffer;     // "Frame" uniform block: scene VP, then an identity VP for the overlay
+	GLintptr OverlayOffset;
 } Matrices;
 
+/* Contents of the "Frame" uniform block, laid out as std140 */
+struct FrameUniforms {
+	glm::mat4 VP;
+	GLfloat fall;    // distance the bricks have fallen, see the GPU brick animation
+	GLfloat pad[3];
+};
+
 GLuint programID;
 
 /* Function to load Shaders - Use it as it is */
@@ -117,86 +146,912 @@ static void error_callback(int error, const char* description)
 
 void quit(GLFWwindow *window)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    // Let the main loop finish the frame and shut down, so the profile and stats get written
+    glfwSetWindowShouldClose(window, GL_TRUE);
 //    exit(EXIT_SUCCESS);
 }
 
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/******************************
+ * Instrumented GL call layer *
+ ******************************/
+
+/* Thin wrappers around the GL calls made per object. They count what the
+   renderer asks of the driver each frame; build with -DNO_GL_STATS to turn
+   them back into the plain GL calls. */
+struct GLStats {
+    int draw_calls;
+    int binds;            // VAO, buffer and program binds
+    int uniform_uploads;
+    int state_changes;    // polygon mode and vertex attribute enables
+    long bytes_uploaded;  // buffer and uniform data sent to the driver
+} gl_stats;
+
+#ifdef NO_GL_STATS
+#define GL_COUNT(field, n) ((void)0)
+#else
+#define GL_COUNT(field, n) (gl_stats.field += (n))
+#endif
+
+inline void glcDrawArrays (GLenum mode, GLint first, GLsizei count)
+{
+    GL_COUNT(draw_calls, 1);
+    glDrawArrays(mode, first, count);
+}
+
+inline void glcBindVertexArray (GLuint array)
+{
+    GL_COUNT(binds, 1);
+    glBindVertexArray(array);
+}
+
+inline void glcBindBuffer (GLenum target, GLuint buffer)
+{
+    GL_COUNT(binds, 1);
+    glBindBuffer(target, buffer);
+}
+
+inline void glcBindFramebuffer (GLenum target, GLuint framebuffer)
+{
+    GL_COUNT(binds, 1);
+    glBindFramebuffer(target, framebuffer);
+}
+
+inline void glcUseProgram (GLuint program)
+{
+    GL_COUNT(binds, 1);
+    glUseProgram(program);
+}
+
+inline void glcPolygonMode (GLenum face, GLenum mode)
+{
+    GL_COUNT(state_changes, 1);
+    glPolygonMode(face, mode);
+}
+
+inline void glcEnableVertexAttribArray (GLuint index)
+{
+    GL_COUNT(state_changes, 1);
+    glEnableVertexAttribArray(index);
+}
+
+inline void glcDrawArraysInstanced (GLenum mode, GLint first, GLsizei count, GLsizei instances)
+{
+    GL_COUNT(draw_calls, 1);
+    glDrawArraysInstanced(mode, first, count, instances);
+}
+
+inline void glcDrawElementsInstancedBaseVertex (GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei instances, GLint basevertex)
+{
+    GL_COUNT(draw_calls, 1);
+    glDrawElementsInstancedBaseVertex(mode, count, type, indices, instances, basevertex);
+}
+
+inline void glcVertexAttribPointer (GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void *pointer)
+{
+    GL_COUNT(state_changes, 1);
+    glVertexAttribPointer(index, size, type, normalized, stride, pointer);
+}
+
+inline void glcUniformMatrix4fv (GLint location, GLsizei count, GLboolean transpose, const GLfloat *value)
+{
+    GL_COUNT(uniform_uploads, 1);
+    GL_COUNT(bytes_uploaded, 16*sizeof(GLfloat)*count);
+    glUniformMatrix4fv(location, count, transpose, value);
+}
+
+inline void glcBufferData (GLenum target, GLsizeiptr size, const void *data, GLenum usage)
+{
+    // Orphaning with a NULL pointer sends no data
+    GL_COUNT(bytes_uploaded, data ? size : 0);
+    glBufferData(target, size, data, usage);
+}
+
+inline void glcBufferSubData (GLenum target, GLintptr offset, GLsizeiptr size, const void *data)
+{
+    GL_COUNT(bytes_uploaded, size);
+    glBufferSubData(target, offset, size, data);
+}
+
+/* Shadow copy of the GL state the renderer touches, so that binding what is
+   already bound costs nothing. Anything that changes this state behind the
+   cache's back must call invalidateRenderState(). */
+struct RenderState {
+    GLuint program;
+    GLuint vertex_array;
+    GLuint array_buffer;
+    GLenum fill_mode;
+} render_state;
+
+/* Framebuffer frames are drawn into: the window's, or an offscreen one when headless */
+GLuint scene_framebuffer = 0;
+
+void invalidateRenderState ()
+{
+    render_state.program = render_state.vertex_array = render_state.array_buffer = (GLuint)-1;
+    render_state.fill_mode = GL_NONE;
+}
+
+void useProgram (GLuint program)
+{
+    if (render_state.program == program)
+        return;
+    glcUseProgram(program);
+    render_state.program = program;
+}
+
+void bindVertexArray (GLuint vertex_array)
+{
+    if (render_state.vertex_array == vertex_array)
+        return;
+    glcBindVertexArray(vertex_array);
+    render_state.vertex_array = vertex_array;
+}
+
+void bindArrayBuffer (GLuint buffer)
+{
+    if (render_state.array_buffer == buffer)
+        return;
+    glcBindBuffer(GL_ARRAY_BUFFER, buffer);
+    render_state.array_buffer = buffer;
+}
+
+void setFillMode (GLenum fill_mode)
+{
+    if (render_state.fill_mode == fill_mode)
+        return;
+    glcPolygonMode(GL_FRONT_AND_BACK, fill_mode);
+    render_state.fill_mode = fill_mode;
+}
+
+/*********************
+ * Streaming buffers *
+ *********************/
+
+/* Data rewritten every frame goes into a ring of STREAM_FRAMES regions in one
+   buffer. Writes map their range unsynchronized, so the driver never waits,
+   and a fence placed after each frame's draws guards the region: the CPU
+   only blocks when it comes back to a region the GPU is still reading. */
+#define STREAM_FRAMES 3  // regions, so frames the CPU may run ahead of the GPU
+#define STREAM_ALIGN 64  // allocation alignment; keeps vertex offsets whole
+
+struct StreamBuffer {
+    GLuint buffer;
+    GLsizeiptr region_size;
+    int region;          // region being written
+    GLsizeiptr used;     // bytes allocated in it
+    bool ready;          // its fence has been waited for
+    GLsync fences[STREAM_FRAMES];
+    int stalls;          // waits that found the GPU still reading
+    double stall_time;   // seconds spent in them
+};
+
+void createStreamBuffer (StreamBuffer &sb, GLsizeiptr region_size)
+{
+    memset(&sb, 0, sizeof(sb));
+    sb.region_size = region_size;
+    glGenBuffers(1, &sb.buffer);
+    glcBindBuffer(GL_ARRAY_BUFFER, sb.buffer);
+    glcBufferData(GL_ARRAY_BUFFER, STREAM_FRAMES*region_size, NULL, GL_STREAM_DRAW);
+}
+
+/* Block until the GPU is done with the current region */
+void waitStreamRegion (StreamBuffer &sb)
+{
+    GLsync &fence = sb.fences[sb.region];
+    if (fence) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+                ;
+            sb.stalls++;
+            sb.stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    sb.ready = true;
+}
+
+/* Fence what was written so far and move on to the next region */
+void advanceStreamBuffer (StreamBuffer &sb)
+{
+    if (sb.used == 0)
+        return;
+    sb.fences[sb.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    sb.region = (sb.region + 1) % STREAM_FRAMES;
+    sb.used = 0;
+    sb.ready = false;
+}
+
+/* Copy size bytes into the ring and return their offset in sb.buffer, which is left bound to GL_ARRAY_BUFFER */
+GLintptr streamWrite (StreamBuffer &sb, const void *data, GLsizeiptr size)
+{
+    if (sb.used + size > sb.region_size)
+        advanceStreamBuffer(sb); // more than a frame's worth: spill into the next region
+    if (!sb.ready)
+        waitStreamRegion(sb);
+    GLintptr offset = sb.region*sb.region_size + sb.used;
+    sb.used += (size + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+
+    bindArrayBuffer(sb.buffer);
+    if (size > 0) {
+        void *dst = glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (dst) {
+            memcpy(dst, data, size);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            GL_COUNT(bytes_uploaded, size);
+        }
+        else {
+            // The map can fail (out of memory, lost context); let the driver copy instead
+            fprintf(stderr, "Cannot map stream buffer, uploading %ld bytes with glBufferSubData\n", (long)size);
+            glcBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+        }
+    }
+    return offset;
+}
+
+/**************
+ * GPU timers *
+ **************/
+
+/* GL_TIME_ELAPSED queries bracket each render pass, so the overlay and the
+   trace can show what the GPU spends where. Only one query can run at a time,
+   so starting a pass ends the previous one, and a pass drawn in several
+   pieces adds them up. A frame's queries are read GPU_TIMER_FRAMES frames
+   later, when they are long done; reading them sooner would stall. */
+#define GPU_TIMER_FRAMES 4
+#define GPU_TIMER_QUERIES 16  // pass segments per frame
+
+enum GPUPass { GPU_PASS_STATIC, GPU_PASS_BRICKS, GPU_PASS_BEAMS, GPU_PASS_CANNON, GPU_PASS_SCENERY, GPU_PASS_HUD, GPU_PASSES };
+
+const char *gpu_pass_counters[GPU_PASSES] = {
+    "gpu static layers us", "gpu bricks us", "gpu beams us", "gpu cannon us", "gpu scenery us", "gpu hud us"
+};
+
+struct GPUTimerFrame {
+    GLuint queries[GPU_TIMER_QUERIES];
+    GPUPass passes[GPU_TIMER_QUERIES];
+    int count;
+};
+
+struct GPUTimers {
+    bool created;
+    GPUTimerFrame frames[GPU_TIMER_FRAMES];
+    int frame;                  // the one being recorded
+    int active;                 // pass being timed, or -1
+    float ms[GPU_PASSES];       // as of the last frame read back
+    long long late;             // frames whose results were still not ready
+} gpu_timers;
+
+void createGPUTimers ()
+{
+    GPUTimers &t = gpu_timers;
+    for (int f = 0; f < GPU_TIMER_FRAMES; f++)
+        glGenQueries(GPU_TIMER_QUERIES, t.frames[f].queries);
+    t.active = -1;
+    t.created = true;
+}
+
+/* Time what follows as the given pass, until the next pass starts */
+void gpuPass (GPUPass pass)
+{
+    GPUTimers &t = gpu_timers;
+    if (!t.created or t.active == pass)
+        return;
+    GPUTimerFrame &f = t.frames[t.frame];
+    if (t.active >= 0)
+        glEndQuery(GL_TIME_ELAPSED);
+    t.active = -1;
+    if (f.count == GPU_TIMER_QUERIES)
+        return;
+    glBeginQuery(GL_TIME_ELAPSED, f.queries[f.count]);
+    f.passes[f.count++] = pass;
+    t.active = pass;
+}
+
+/* Collect the results of the frame that used this slot last, then reuse it */
+void beginGPUTimerFrame ()
+{
+    GPUTimers &t = gpu_timers;
+    if (!t.created)
+        return;
+    GPUTimerFrame &f = t.frames[t.frame];
+    if (f.count > 0) {
+        // Queries finish in order: if the last one is done, all of them are
+        GLint available = 0;
+        glGetQueryObjectiv(f.queries[f.count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            memset(t.ms, 0, sizeof(t.ms));
+            for (int i = 0; i < f.count; i++) {
+                GLuint64 ns = 0;
+                glGetQueryObjectui64v(f.queries[i], GL_QUERY_RESULT, &ns);
+                t.ms[f.passes[i]] += ns * 1e-6f;
+            }
+        }
+        else
+            t.late++;
+    }
+    f.count = 0;
+}
+
+void endGPUTimerFrame ()
+{
+    GPUTimers &t = gpu_timers;
+    if (!t.created)
+        return;
+    if (t.active >= 0)
+        glEndQuery(GL_TIME_ELAPSED);
+    t.active = -1;
+    t.frame = (t.frame + 1) % GPU_TIMER_FRAMES;
+}
+
+/****************
+ * Render queue *
+ ****************/
+
+/* draw() does not draw objects one at a time. It queues each one with a sort
+   key (layer, program, VAO, fill mode) and a compact 2D transform. At the end
+   of the frame flushRenderQueue() sorts the items and draws each run of items
+   with the same key as one instanced draw, with the transforms streamed into
+   a shared per-instance buffer. The vertex shader composes the transform with
+   the view-projection from the "Frame" uniform block. */
+#define RENDER_QUEUE_MAX 4096
+#define COLOR_ATTRIB 1        // per vertex for streamed objects, per instance for registry meshes
+#define INSTANCE_ATTRIB 2     // vec4 attribute holding the instance transform
+#define FALL_ATTRIB 3         // vec2 per brick attribute, see the GPU brick animation
+#define FRAME_BLOCK_BINDING 0 // uniform buffer binding point of the "Frame" block
+
+/* Offset, rotation about the offset and uniform scale; all this game's objects need */
+struct Instance2D {
+    GLfloat x, y;
+    GLfloat angle; // radians
+    GLfloat scale;
+    GLubyte color[4];
+};
+
+// Drawn in this order. Everything sits at z = 0 under GL_LEQUAL, so a later layer covers an earlier one
+enum RenderLayer { LAYER_STATIC, LAYER_BEAMS, LAYER_TURRET, LAYER_FAN, LAYER_BRICKS, LAYER_FLOOR, LAYER_SCENERY, LAYER_WALL, LAYER_COUNT };
+
+// The GPU timer pass each layer is counted in
+const GPUPass layer_passes[] = { GPU_PASS_STATIC, GPU_PASS_BEAMS, GPU_PASS_CANNON, GPU_PASS_CANNON, GPU_PASS_BRICKS, GPU_PASS_SCENERY, GPU_PASS_SCENERY, GPU_PASS_SCENERY };
+
+struct RenderQueue {
+    StreamBuffer instances;
+    GLintptr instance_offset; // where the last flush's transforms start in instances
+    int count, batches;
+    int drawn;                // sorted items already drawn by drawQueuedLayers
+    unsigned int keys[RENDER_QUEUE_MAX], items[RENDER_QUEUE_MAX];
+    unsigned int scratch_keys[RENDER_QUEUE_MAX], scratch_items[RENDER_QUEUE_MAX];
+    VAO *vaos[RENDER_QUEUE_MAX];
+    Instance2D transforms[RENDER_QUEUE_MAX];
+    Instance2D sorted_transforms[RENDER_QUEUE_MAX];
+} render_queue;
+
+void createRenderQueue ()
+{
+    // Room for two full flushes a frame: the static layers and the rest
+    createStreamBuffer(render_queue.instances, 2*RENDER_QUEUE_MAX*sizeof(Instance2D));
+
+    // One slot for the scene's uniforms, rewritten every frame, and a static
+    // identity for the overlay, each aligned as glBindBufferRange requires
+    GLint align = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    Matrices.OverlayOffset = (sizeof(FrameUniforms) + align - 1) / align * align;
+    FrameUniforms overlay = { glm::mat4(1.0f), 0, {0, 0, 0} };
+    glGenBuffers(1, &Matrices.UniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, Matrices.UniformBuffer);
+    glcBufferData(GL_UNIFORM_BUFFER, Matrices.OverlayOffset + sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glcBufferSubData(GL_UNIFORM_BUFFER, Matrices.OverlayOffset, sizeof(FrameUniforms), &overlay);
+}
+
+/* Select which VP the "Frame" block sees: the scene's or the overlay's identity */
+void bindFrameUniforms (bool overlay)
+{
+    GL_COUNT(binds, 1);
+    glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, Matrices.UniformBuffer, overlay ? Matrices.OverlayOffset : 0, sizeof(FrameUniforms));
+}
+
+/* Point the bound VAO's instance attributes at the transform and colour of instance 'first' */
+void setInstanceAttribs (int first)
+{
+    GLintptr offset = render_queue.instance_offset + first*sizeof(Instance2D);
+    bindArrayBuffer(render_queue.instances.buffer);
+    glcVertexAttribPointer(INSTANCE_ATTRIB, 4, GL_FLOAT, GL_FALSE, sizeof(Instance2D), (void*)offset);
+    glcVertexAttribPointer(COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Instance2D), (void*)(offset + offsetof(Instance2D, color)));
+}
+
+/*****************
+ * Mesh registry *
+ *****************/
+
+/* Every static mesh lives in one indexed vertex buffer behind one VAO and is
+   drawn by its base vertex and index offset. Meshes with the same vertices
+   share storage, so objects that differ only in colour (the bricks, the
+   buckets) are one mesh, and one batch in the render queue: their colour
+   travels with each instance instead of with the vertices. */
+struct MeshVertex {
+    GLfloat x, y; // z is always 0
+};
+
+struct Mesh {
+    std::vector<MeshVertex> vertices;
+    std::vector<GLushort> indices; // meshes are small, 16 bits is plenty
+    int refs;
+    GLint base_vertex;             // placement in the shared buffers, set by uploadMeshes()
+    int first_index;
+};
+
+struct MeshRegistry {
+    GLuint vertex_array, vertex_buffer, index_buffer;
+    std::vector<Mesh> meshes;
+    bool dirty;                    // the shared buffers need repacking
+    int vertex_count, index_count; // as last uploaded
+} mesh_registry;
+
+/* The shared VAO: vertices and indices from the registry, transform and colour per instance */
+void createMeshRegistry ()
+{
+    MeshRegistry &r = mesh_registry;
+    glGenVertexArrays(1, &r.vertex_array);
+    glGenBuffers(1, &r.vertex_buffer);
+    glGenBuffers(1, &r.index_buffer);
+
+    bindVertexArray(r.vertex_array);
+    glcBindBuffer(GL_ELEMENT_ARRAY_BUFFER, r.index_buffer); // VAO state
+    bindArrayBuffer(r.vertex_buffer);
+    glcVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)0);
+    glcEnableVertexAttribArray(0);
+
+    setInstanceAttribs(0);
+    glVertexAttribDivisor(COLOR_ATTRIB, 1);
+    glVertexAttribDivisor(INSTANCE_ATTRIB, 1);
+    glcEnableVertexAttribArray(COLOR_ATTRIB);
+    glcEnableVertexAttribArray(INSTANCE_ATTRIB);
+}
+
+/* Index the given triangle soup (x,y,z per vertex, z ignored) and return the
+   registry mesh holding it, sharing an existing one if its vertices and
+   indices are the same */
+int registerMesh (int numVertices, const GLfloat* vertex_buffer_data)
+{
+    Mesh mesh;
+    mesh.refs = 1;
+    mesh.base_vertex = mesh.first_index = 0;
+    for (int i = 0; i < numVertices; i++) {
+        MeshVertex v = { vertex_buffer_data[3*i], vertex_buffer_data[3*i + 1] };
+        size_t j = 0;
+        while (j < mesh.vertices.size() and memcmp(&mesh.vertices[j], &v, sizeof(v)) != 0)
+            j++;
+        if (j == mesh.vertices.size())
+            mesh.vertices.push_back(v);
+        mesh.indices.push_back((GLushort)j);
+    }
+
+    MeshRegistry &r = mesh_registry;
+    int free_slot = -1;
+    for (size_t m = 0; m < r.meshes.size(); m++) {
+        Mesh &other = r.meshes[m];
+        if (other.refs == 0) {
+            if (free_slot < 0)
+                free_slot = m;
+        }
+        else if (other.vertices.size() == mesh.vertices.size() and other.indices == mesh.indices
+                 and memcmp(&other.vertices[0], &mesh.vertices[0], mesh.vertices.size()*sizeof(MeshVertex)) == 0) {
+            other.refs++;
+            return m;
+        }
+    }
+    r.dirty = true;
+    if (free_slot >= 0) {
+        r.meshes[free_slot].vertices.swap(mesh.vertices);
+        r.meshes[free_slot].indices.swap(mesh.indices);
+        r.meshes[free_slot].refs = 1;
+        return free_slot;
+    }
+    r.meshes.push_back(mesh);
+    return r.meshes.size() - 1;
+}
+
+/* Drop one user of a mesh; its storage is reclaimed at the next upload */
+void releaseMesh (int m)
+{
+    Mesh &mesh = mesh_registry.meshes[m];
+    if (--mesh.refs > 0)
+        return;
+    std::vector<MeshVertex>().swap(mesh.vertices);
+    std::vector<GLushort>().swap(mesh.indices);
+    mesh_registry.dirty = true;
+}
+
+/* Pack the live meshes back to back into the shared buffers, if any changed */
+void uploadMeshes ()
+{
+    MeshRegistry &r = mesh_registry;
+    if (!r.dirty)
+        return;
+    std::vector<MeshVertex> vertices;
+    std::vector<GLushort> indices;
+    for (size_t m = 0; m < r.meshes.size(); m++) {
+        Mesh &mesh = r.meshes[m];
+        mesh.base_vertex = vertices.size();
+        mesh.first_index = indices.size();
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+    }
+    r.vertex_count = vertices.size();
+    r.index_count = indices.size();
+
+    bindVertexArray(r.vertex_array);
+    bindArrayBuffer(r.vertex_buffer);
+    glcBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(MeshVertex), vertices.empty() ? NULL : &vertices[0], GL_STATIC_DRAW);
+    glcBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLushort), indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+    r.dirty = false;
+}
+
+/* Vertex of a streamed object: clip space position as normalized shorts and
+   an RGBA8 colour, 8 bytes in one interleaved buffer */
+struct StreamVertex {
+    GLshort x, y;
+    GLubyte color[4];
+};
+
+/* Generate a VAO of its own, reading from a new stream buffer, for an object
+   whose maxVertices StreamVertex vertices are rewritten as it is drawn (the
+   HUD); it is drawn with draw3DObject from where streamWrite put them */
+struct VAO* createStreamObject (StreamBuffer &stream, GLenum primitive_mode, int maxVertices, GLenum fill_mode=GL_FILL)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
+    vao->NumVertices = 0;
     vao->FillMode = fill_mode;
+    vao->SortId = -1; // never queued
+    vao->Mesh = -1;
+    vao->ColorBuffer = 0; // colours are interleaved with the positions
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+    createStreamBuffer(stream, maxVertices*sizeof(StreamVertex)); // VBO - vertices and colors
+    vao->VertexBuffer = stream.buffer;
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+    bindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    bindArrayBuffer (vao->VertexBuffer); // Bind the VBO 
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
+                          2,                  // size (x,y)
+                          GL_SHORT,           // type
+                          GL_TRUE,            // normalized? -32767..32767 maps to -1..1
+                          sizeof(StreamVertex), // stride
                           (void*)0            // array buffer offset
                           );
+    glcEnableVertexAttribArray(0); // Enabled arrays are VAO state, so once is enough
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
+                          COLOR_ATTRIB,       // attribute 1. Color
+                          4,                  // size (r,g,b,a)
+                          GL_UNSIGNED_BYTE,   // type
+                          GL_TRUE,            // normalized?
+                          sizeof(StreamVertex), // stride
+                          (void*)offsetof(StreamVertex, color) // array buffer offset
                           );
+    glcEnableVertexAttribArray(COLOR_ATTRIB);
+
+    // Attribute 2 stays disabled: the transform is the constant set in initGL
 
     return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+/* Add a mesh to the registry and return a handle to draw it in one colour through the render queue */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+    vao->Mesh = registerMesh(numVertices, vertex_buffer_data);
+    vao->SortId = vao->Mesh; // same geometry, same batch
+    vao->VertexArrayID = mesh_registry.vertex_array;
+    vao->VertexBuffer = vao->ColorBuffer = 0;
+    vao->Color[0] = (GLubyte)lround(red*255);
+    vao->Color[1] = (GLubyte)lround(green*255);
+    vao->Color[2] = (GLubyte)lround(blue*255);
+    vao->Color[3] = 255;
+    return vao;
+}
+
+/* Render a streamed object's vertices, from vertex 'first' of its stream buffer.
+   Registry meshes never come here: they share the registry VAO and are drawn
+   by flushRenderQueue, instanced from their base vertex */
+void draw3DObject (struct VAO* vao, int first=0)
+{
+    // Change the Fill Mode for this object
+    setFillMode (vao->FillMode);
+
+    // Bind the VAO to use. createStreamObject pointed its attributes at the
+    // stream buffer, so nothing else needs binding
+    bindVertexArray (vao->VertexArrayID);
+
+    // Draw the geometry !
+    glcDrawArrays(vao->PrimitiveMode, first, vao->NumVertices); // the caller sets NumVertices to what it streamed
+}
+
+/* Add an object to this frame's render queue with its transform and colour */
+void queueInstance (RenderLayer layer, struct VAO* vao, const Instance2D &instance)
+{
+    RenderQueue &q = render_queue;
+    if (q.count == RENDER_QUEUE_MAX)
+        return;
+    q.keys[q.count] = (unsigned int)layer << 24 | (programID & 0xff) << 16 | (vao->SortId & 0x7fff) << 1 | (vao->FillMode == GL_LINE);
+    q.items[q.count] = q.count;
+    q.vaos[q.count] = vao;
+    q.transforms[q.count] = instance;
+    q.count++;
+}
+
+/* Write this frame's view-projection and brick fall into the "Frame" uniform block */
+void updateFrameUniforms (const glm::mat4 &VP, float fall=0)
+{
+    FrameUniforms frame = { VP, fall, {0, 0, 0} };
+    GL_COUNT(uniform_uploads, 1);
+    glcBindBuffer(GL_UNIFORM_BUFFER, Matrices.UniformBuffer);
+    glcBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame), &frame);
+    bindFrameUniforms(false);
+}
+
+/* LSD radix sort of keys with their item indices, 8 bits per pass. Stable, so
+   items with equal keys keep the order they were queued in. */
+void radixSort (unsigned int *keys, unsigned int *items, unsigned int *scratch_keys, unsigned int *scratch_items, int n)
+{
+    unsigned int *src_keys = keys, *src_items = items, *dst_keys = scratch_keys, *dst_items = scratch_items;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int offsets[256] = {0};
+        for (int i = 0; i < n; i++)
+            offsets[(src_keys[i] >> shift) & 0xff]++;
+        if (n == 0 or offsets[(src_keys[0] >> shift) & 0xff] == n)
+            continue; // every key has the same digit here
+        for (int d = 0, sum = 0; d < 256; d++) {
+            int c = offsets[d];
+            offsets[d] = sum;
+            sum += c;
+        }
+        for (int i = 0; i < n; i++) {
+            int pos = offsets[(src_keys[i] >> shift) & 0xff]++;
+            dst_keys[pos] = src_keys[i];
+            dst_items[pos] = src_items[i];
+        }
+        swap(src_keys, dst_keys);
+        swap(src_items, dst_items);
+    }
+    if (src_keys != keys) {
+        memcpy(keys, src_keys, n*sizeof(unsigned int));
+        memcpy(items, src_items, n*sizeof(unsigned int));
     }
+}
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+/* Put the queued instances in draw order, into sorted_transforms */
+void sortRenderQueue ()
+{
+    RenderQueue &q = render_queue;
+    radixSort(q.keys, q.items, q.scratch_keys, q.scratch_items, q.count);
+    for (int i = 0; i < q.count; i++)
+        q.sorted_transforms[i] = q.transforms[q.items[i]];
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Sort the queued items and stream their transforms, ready for drawQueuedLayers */
+void prepareRenderQueue ()
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    RenderQueue &q = render_queue;
+    uploadMeshes();
+    sortRenderQueue();
+    q.instance_offset = streamWrite(q.instances, q.sorted_transforms, q.count*sizeof(Instance2D));
+    q.batches = 0;
+    q.drawn = 0;
+}
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+/* Draw the prepared items below layer 'until' not drawn yet, one instanced draw
+   per run of equal keys. Stopping at a layer lets something drawn outside the
+   queue go between two layers */
+void drawQueuedLayers (int until)
+{
+    RenderQueue &q = render_queue;
+    int first, last;
+    for (first = q.drawn; first < q.count and (int)(q.keys[first] >> 24) < until; first = last) {
+        for (last = first + 1; last < q.count and q.keys[last] == q.keys[first]; last++)
+            ;
+        VAO *vao = q.vaos[q.items[first]];
+        const Mesh &mesh = mesh_registry.meshes[vao->Mesh];
+        gpuPass(layer_passes[q.keys[first] >> 24]);
+        setFillMode(vao->FillMode);
+        bindVertexArray(vao->VertexArrayID);
+        setInstanceAttribs(first);
+        glcDrawElementsInstancedBaseVertex(vao->PrimitiveMode, mesh.indices.size(), GL_UNSIGNED_SHORT,
+                                           (void*)(mesh.first_index*sizeof(GLushort)), last - first, mesh.base_vertex);
+        q.batches++;
+    }
+    q.drawn = first;
+}
+
+/* Sort the queued items and draw them all */
+void flushRenderQueue ()
+{
+    prepareRenderQueue();
+    drawQueuedLayers(LAYER_COUNT);
+    render_queue.count = 0;
+}
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+/***********************
+ * Frame command lists *
+ ***********************/
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+/* draw() makes no GL calls. It records what the frame shows as plain data
+   into a linear arena, and the render backend replays that, either right
+   away or on the render thread. Commands are a small header followed by
+   their payload, each rounded up to COMMAND_ALIGN bytes. */
+#define FRAME_ARENA_SIZE (1 << 20)
+#define COMMAND_ALIGN 16
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+enum CommandType { CMD_FRAME, CMD_DRAW, CMD_BRICKS, CMD_HUD };
+
+struct CommandHeader {
+    unsigned int type;
+    unsigned int size;   // header and payload, so the next command starts size bytes on
+    unsigned int pad[2]; // keep payloads aligned
+};
+
+/* Always the first command: what every other command is drawn with */
+#define FRAME_MAX_INPUTS 16
+
+struct FrameCommand {
+    glm::mat4 VP;
+    float fall;          // brick fall distance for the shader
+    int width, height;   // framebuffer size
+    int inputs;          // input events this frame is the first to show
+    long long input_times[FRAME_MAX_INPUTS]; // their profileNow() stamps
+};
+
+/* One object through the render queue */
+struct DrawCommand {
+    VAO *object;         // handles live as long as the program
+    RenderLayer layer;
+    Instance2D instance; // transform and colour
+};
+
+struct FrameArena {
+    char *base;
+    size_t used;
+    int dropped;         // commands that did not fit this frame
+};
+
+void createFrameArena (FrameArena &arena)
+{
+    arena.base = new char [FRAME_ARENA_SIZE];
+    arena.used = 0;
+    arena.dropped = 0;
+}
+
+/* Append a command with a payload of the given size and return the payload, or NULL if the arena is full */
+void* recordCommand (FrameArena &arena, CommandType type, size_t size)
+{
+    size_t total = (sizeof(CommandHeader) + size + COMMAND_ALIGN - 1) / COMMAND_ALIGN * COMMAND_ALIGN;
+    if (arena.used + total > FRAME_ARENA_SIZE) {
+        arena.dropped++;
+        return NULL;
+    }
+    CommandHeader *header = (CommandHeader*)(arena.base + arena.used);
+    header->type = type;
+    header->size = total;
+    arena.used += total;
+    return header + 1;
+}
+
+/* The command recorded after this one */
+inline const CommandHeader* nextCommand (const CommandHeader *header)
+{
+    return (const CommandHeader*)((const char*)header + header->size);
+}
+
+/* Record an object placed at x,y and rotated by angle radians */
+void recordDraw (FrameArena &arena, RenderLayer layer, struct VAO* vao, float x, float y, float angle, float scale=1)
+{
+    DrawCommand *cmd = (DrawCommand*)recordCommand(arena, CMD_DRAW, sizeof(DrawCommand));
+    if (!cmd)
+        return;
+    cmd->object = vao;
+    cmd->layer = layer;
+    cmd->instance.x = x;
+    cmd->instance.y = y;
+    cmd->instance.angle = angle;
+    cmd->instance.scale = scale;
+    memcpy(cmd->instance.color, vao->Color, sizeof(cmd->instance.color)); // fixed at creation, safe to read here
+}
+
+/* What replays recorded frames and shows them. The game only records; the
+   backend picked at startup is the one thing that knows how to draw */
+struct RenderBackend {
+    const char *name;
+    void (*render) (const FrameArena &arena);
+    void (*present) (GLFWwindow *window);
+    // The frame just rendered as RGBA8, top row first; false if there is none
+    bool (*read) (std::vector<unsigned int> &pixels, int &width, int &height);
+};
+
+/*****************
+ * Static layers *
+ *****************/
+
+/* Scenery that never moves and lies under everything else (the mirrors) is
+   drawn once into an offscreen colour texture and copied to the window at the
+   start of every frame. The floor and the wall never move either, but they
+   cover the bricks and the cannon, so they are drawn every frame in their
+   own layers. The copy is redrawn only when it goes stale: after a resize,
+   or when the view-projection it was drawn with changes. */
+struct StaticLayers {
+    GLuint framebuffer, texture;
+    int width, height;
+    bool valid;
+    glm::mat4 VP; // view-projection the texture was drawn with
+    int redraws;
+} static_layers;
+
+/* Force a redraw of the static layers on the next frame */
+void invalidateStaticLayers ()
+{
+    static_layers.valid = false;
+}
+
+/* (Re)allocate the offscreen texture at the framebuffer size */
+void resizeStaticLayers (int width, int height)
+{
+    StaticLayers &s = static_layers;
+    if (s.framebuffer == 0) {
+        glGenFramebuffers(1, &s.framebuffer);
+        glGenTextures(1, &s.texture);
+    }
+    s.width = width;
+    s.height = height;
+    glBindTexture(GL_TEXTURE_2D, s.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glcBindFramebuffer(GL_FRAMEBUFFER, s.framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s.texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        cout << "Static layer framebuffer incomplete" << endl;
+    glcBindFramebuffer(GL_FRAMEBUFFER, scene_framebuffer);
+    invalidateStaticLayers();
+}
+
+/* Does the texture need redrawing before it can be used with VP? */
+bool staticLayersStale (const glm::mat4 &VP)
+{
+    return !static_layers.valid or memcmp(&static_layers.VP[0][0], &VP[0][0], sizeof(glm::mat4)) != 0;
+}
+
+/* Direct the following flushes into the static layer texture */
+void beginStaticLayers ()
+{
+    glcBindFramebuffer(GL_FRAMEBUFFER, static_layers.framebuffer);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+/* Back to the scene; the texture now holds what was drawn with VP */
+void endStaticLayers (const glm::mat4 &VP)
+{
+    glcBindFramebuffer(GL_FRAMEBUFFER, scene_framebuffer);
+    static_layers.VP = VP;
+    static_layers.valid = true;
+    static_layers.redraws++;
+}
+
+/* Start the scene's frame from the static layers instead of a colour clear */
+void compositeStaticLayers ()
+{
+    StaticLayers &s = static_layers;
+    glcBindFramebuffer(GL_READ_FRAMEBUFFER, s.framebuffer);
+    glBlitFramebuffer(0, 0, s.width, s.height, 0, 0, s.width, s.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glcBindFramebuffer(GL_READ_FRAMEBUFFER, scene_framebuffer);
+    glClear(GL_DEPTH_BUFFER_BIT);
 }
 
 /**************************
@@ -232,78 +1087,661 @@ int lives = 5;
 int objectsel = 0;
 double xpos, ypos;
 
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
+/* Brick slots the game moved since the last recorded frame other than by
+   falling, for the renderer to pick up; see the GPU brick animation */
+#define BRICK_SLOTS (1001 + 501 + 501) // black, red, green
 
-/* Executed for character input (like in text boxes) */
-void keyboardChar (GLFWwindow* window, unsigned int key)
+struct BrickMarks {
+    bool marked[BRICK_SLOTS];
+    int pending[BRICK_SLOTS], count; // in marking order
+} brick_marks;
+
+/* Slot of brick i in the array of y positions 'by' */
+int brickSlot (const float *by, int i)
 {
-	switch (key) {
-		case 'Q':
-		case 'q':
-            quit(window);
-            break;
-		default:
-			break;
-	}
+    return by == tr_y ? i : by == rb_y ? 1001 + i : 1502 + i;
 }
 
-
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/* Have the next recorded frame send brick i again */
+void markBrick (const float *by, int i)
 {
-   	switch (button) 
-   	{
-        case GLFW_MOUSE_BUTTON_LEFT:
-            if (action == GLFW_PRESS and xpos > 0 and xpos < 100 and ypos > fabs(lasery + 0.5 - 4) * 100 and ypos < fabs(lasery - 0.5 - 4)*100 and lasery < 3.0)lasery += 0.2;
-            break;
-   	    case GLFW_MOUSE_BUTTON_RIGHT:
-            if (action == GLFW_PRESS and xpos > 0 and xpos < 100 and ypos > fabs(lasery + 0.5 - 4) * 100 and ypos < fabs(lasery - 0.5 - 4)*100 and lasery > -2.8)lasery -= 0.2;
-            break;
-        default:
-            break;
-    }
+    BrickMarks &m = brick_marks;
+    int slot = brickSlot(by, i);
+    if (m.marked[slot])
+        return;
+    m.marked[slot] = true;
+    m.pending[m.count++] = slot;
 }
 
-void scroll (GLFWwindow* window, double xoffset, double yoffset)
+void markAllBricks ()
 {
-	if(yoffset > 0 and laserangle < 45 and xpos > 0 and xpos < 100 and ypos > (fabs(lasery + 0.5 - 4) * 100) and ypos < fabs(lasery - 0.5 - 4)*100)
-	{
-		laserangle += 9;
-	}
-	else if(yoffset < 0 and laserangle > -45 and xpos > 0 and xpos < 100 and ypos > fabs(lasery + 0.5 - 4) * 100 and ypos < fabs(lasery - 0.5 - 4)*100)
-	{
-		laserangle -= 9;
-	}
-	else if(yoffset < 0 and red_x > -2 and xpos < fabs(red_x + 4)*100 + 38 and xpos > fabs(red_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)red_x -= 0.05;
-	else if(yoffset < 0 and green_x > -2 and xpos < fabs(green_x + 4)*100 + 38 and xpos > fabs(green_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)green_x -= 0.05;
-	else if(yoffset > 0 and red_x < 2 and xpos < fabs(red_x + 4)*100 + 38 and xpos > fabs(red_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)red_x += 0.05;
-    else if(yoffset > 0 and green_x < 2 and xpos < fabs(green_x + 4)*100 + 38 and xpos > fabs(green_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)green_x += 0.05;
+    for (int i = 0; i <= 1000; i++)
+        markBrick(tr_y, i);
+    for (int i = 0; i <= 500; i++) {
+        markBrick(rb_y, i);
+        markBrick(gb_y, i);
+    }
 }
 
-void cursor_pos_callback(GLFWwindow* window, double xcoord, double ycoord)
+/* Monotonic wall clock in seconds, usable from any thread */
+double hiresTime ()
 {
-	xpos = xcoord;
-	ypos = ycoord;	
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+/************
+ * Profiler *
+ ************/
+
+/* Scoped timers go into a ring buffer owned by the thread that records them.
+   Only the owner writes, so recording is a plain store plus one release of
+   the head index; the dump reads whatever the rings hold at that moment. */
+#define PROFILE_RING_SIZE 65536  // events kept per thread, power of two
+#define PROFILE_MAX_THREADS 8
+#define PROFILE_TRACE_FILE "brickbreaker_trace.json"
+
+struct ProfileEvent {
+    const char *name;
+    long long start, duration; // nanoseconds since profile.epoch
+    char phase;                // 'X' for a timed scope, 'C' for a counter (value in duration)
+};
 
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
-{
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-     is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+struct ProfileRing {
+    ProfileEvent events[PROFILE_RING_SIZE];
+    std::atomic<unsigned int> head;
+    const char *thread_name;
+};
 
-	GLfloat fov = 90.0f;
+struct Profiler {
+    std::chrono::steady_clock::time_point epoch;
+    ProfileRing *rings[PROFILE_MAX_THREADS];
+    std::atomic<int> ring_count;
+    std::vector<float> frame_ms;
+} profile;
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+thread_local ProfileRing *profile_ring = NULL;
 
-	// set the projection matrix as perspective
-	/* glMatrixMode (GL_PROJECTION);
+long long profileNow ()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profile.epoch).count();
+}
+
+void profileInit ()
+{
+    profile.epoch = std::chrono::steady_clock::now();
+    profile.frame_ms.reserve(1 << 16);
+}
+
+/* Give the calling thread its own ring; must run before it records anything */
+void profileThread (const char *name)
+{
+    int slot = profile.ring_count.fetch_add(1);
+    if (slot >= PROFILE_MAX_THREADS)
+        return;
+    ProfileRing *ring = new ProfileRing;
+    ring->head = 0;
+    ring->thread_name = name;
+    profile.rings[slot] = ring;
+    profile_ring = ring;
+}
+
+void profilePush (const char *name, long long start, long long duration, char phase)
+{
+    ProfileRing *ring = profile_ring;
+    if (!ring)
+        return;
+    unsigned int head = ring->head.load(std::memory_order_relaxed);
+    ProfileEvent &ev = ring->events[head & (PROFILE_RING_SIZE - 1)];
+    ev.name = name;
+    ev.start = start;
+    ev.duration = duration;
+    ev.phase = phase;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void profileRecord (const char *name, long long start, long long end)
+{
+    profilePush(name, start, end - start, 'X');
+}
+
+/* A sampled value, shown as its own track in the trace viewer */
+void profileCounter (const char *name, long long value)
+{
+    profilePush(name, profileNow(), value, 'C');
+}
+
+struct ProfileScope {
+    const char *name;
+    long long start;
+    ProfileScope (const char *n) : name(n), start(profileNow()) {}
+    ~ProfileScope () { profileRecord(name, start, profileNow()); }
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+/* For long stretches of straight-line code: close the section started at 'start' and open the next */
+long long profileLap (const char *name, long long start)
+{
+    long long now = profileNow();
+    profileRecord(name, start, now);
+    return now;
+}
+
+/* Write every ring as Chrome trace JSON (load it in chrome://tracing or Perfetto) */
+void profileDump (const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write trace to %s\n", path);
+        return;
+    }
+    fprintf(out, "{\"traceEvents\":[\n");
+    bool first = true;
+    int threads = min(profile.ring_count.load(), PROFILE_MAX_THREADS);
+    for (int t = 0; t < threads; t++) {
+        ProfileRing *ring = profile.rings[t];
+        if (!ring)
+            continue;
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", t, ring->thread_name);
+        first = false;
+
+        unsigned int head = ring->head.load(std::memory_order_acquire);
+        unsigned int begin = head > PROFILE_RING_SIZE ? head - PROFILE_RING_SIZE : 0;
+        for (unsigned int i = begin; i != head; i++) {
+            const ProfileEvent &ev = ring->events[i & (PROFILE_RING_SIZE - 1)];
+            if (ev.phase == 'C')
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                        ev.name, t, ev.start / 1000.0, ev.duration);
+            else
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        ev.name, t, ev.start / 1000.0, ev.duration / 1000.0);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    cout << "Wrote profile trace to " << path << endl;
+}
+
+void profileFrame (float ms)
+{
+    profile.frame_ms.push_back(ms);
+}
+
+/* Frame time percentiles over the whole run */
+void profileReport ()
+{
+    std::vector<float> sorted(profile.frame_ms);
+    if (sorted.empty())
+        return;
+    std::sort(sorted.begin(), sorted.end());
+    int n = sorted.size();
+    printf("Frame times over %d frames: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           n, sorted[n*50/100], sorted[n*95/100], sorted[n*99/100], sorted[n-1]);
+}
+
+/*****************
+ * Input latency *
+ *****************/
+
+/* Keyboard, mouse button and scroll events are stamped as they come in,
+   and the stamp is kept when the next tick applies them. The callbacks run in
+   glfwPollEvents at the end of a frame, so the next frame is the first to
+   show the event: it takes the stamps when it is recorded and carries them
+   to the renderer. The renderer measures from each
+   stamp to the return of the frame's present (glfwSwapBuffers, or glFinish
+   offscreen). The latencies go to a histogram printed at exit. */
+#define LATENCY_BUCKET_MS 2
+#define LATENCY_BUCKETS 50    // the last one also holds everything slower
+
+struct InputLatency {
+    // Main thread
+    long long pending[FRAME_MAX_INPUTS];
+    int pending_count;
+    long long dropped;        // more events than a frame carries
+
+    // Renderer side
+    long long histogram[LATENCY_BUCKETS];
+    std::vector<float> samples;   // ms
+} input_latency;
+
+/* Called for each input event the tick applies, with the time it came in */
+void stampInput (long long time)
+{
+    InputLatency &l = input_latency;
+    if (l.pending_count == FRAME_MAX_INPUTS)
+        l.dropped++;
+    else
+        l.pending[l.pending_count++] = time;
+}
+
+/* Hand the stamps taken since the last frame to the one being recorded */
+void takeInputs (FrameCommand &frame)
+{
+    InputLatency &l = input_latency;
+    frame.inputs = l.pending_count;
+    memcpy(frame.input_times, l.pending, l.pending_count*sizeof(long long));
+    l.pending_count = 0;
+}
+
+/* Measure each input the frame showed, right after it was presented */
+void measureInputLatency (const FrameArena &arena)
+{
+    InputLatency &l = input_latency;
+    const FrameCommand &frame = *(const FrameCommand*)((const CommandHeader*)arena.base + 1);
+    if (frame.inputs == 0)
+        return;
+    long long presented = profileNow();
+    for (int i = 0; i < frame.inputs; i++) {
+        float ms = (presented - frame.input_times[i]) * 1e-6f;
+        l.histogram[min((int)(ms / LATENCY_BUCKET_MS), LATENCY_BUCKETS - 1)]++;
+        l.samples.push_back(ms);
+        profileCounter("input latency us", ms * 1000);
+    }
+}
+
+void latencyReport ()
+{
+    InputLatency &l = input_latency;
+    int n = l.samples.size();
+    if (n == 0)
+        return;
+    std::vector<float> sorted(l.samples);
+    std::sort(sorted.begin(), sorted.end());
+    printf("Input to present latency over %d inputs: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           n, sorted[n*50/100], sorted[n*95/100], sorted[n*99/100], sorted[n-1]);
+    if (l.dropped)
+        printf("  %lld inputs not measured, too many in one frame\n", l.dropped);
+
+    int first = 0, last = LATENCY_BUCKETS - 1;
+    long long most = 0;
+    while (l.histogram[first] == 0)
+        first++;
+    while (l.histogram[last] == 0)
+        last--;
+    for (int b = first; b <= last; b++)
+        most = max(most, l.histogram[b]);
+    for (int b = first; b <= last; b++) {
+        if (b == LATENCY_BUCKETS - 1)
+            printf("  %3d+    ms %6lld ", b*LATENCY_BUCKET_MS, l.histogram[b]);
+        else
+            printf("  %3d-%-3d ms %6lld ", b*LATENCY_BUCKET_MS, (b + 1)*LATENCY_BUCKET_MS, l.histogram[b]);
+        printf("%s\n", std::string(l.histogram[b] * 40 / most, '#').c_str());
+    }
+}
+
+/***************
+ * Input queue *
+ ***************/
+
+/* The GLFW callbacks do not touch game state. They push a timestamped event
+   into a fixed ring and the simulation drains it at the start of each tick,
+   so the two sides can run on different threads. There is one producer (the
+   thread polling GLFW) and one consumer (the tick): each side owns one index
+   and publishes it with a release store, so neither ever locks or allocates.
+   When the ring is full the newest event is dropped and counted. */
+#define INPUT_QUEUE_SIZE 1024   // power of two; cursor moves come in bursts
+
+enum InputType { INPUT_KEY, INPUT_BUTTON, INPUT_SCROLL, INPUT_CURSOR };
+
+struct InputEvent {
+    InputType type;
+    int code, action;      // key or mouse button, and GLFW_PRESS/REPEAT/RELEASE
+    double x, y;           // scroll offsets or cursor position
+    long long time;        // profileNow() when the callback ran
+};
+
+struct InputQueue {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    std::atomic<unsigned> head;    // next event to drain, written by the consumer
+    std::atomic<unsigned> tail;    // next free slot, written by the producer
+    long long dropped;             // producer only
+} input_queue;
+
+/* Producer side, called from the GLFW callbacks */
+void pushInput (InputType type, int code, int action, double x, double y)
+{
+    InputQueue &q = input_queue;
+    unsigned tail = q.tail.load(std::memory_order_relaxed);
+    if (tail - q.head.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE) {
+        q.dropped++;
+        return;
+    }
+    InputEvent &e = q.events[tail & (INPUT_QUEUE_SIZE - 1)];
+    e.type = type;
+    e.code = code;
+    e.action = action;
+    e.x = x;
+    e.y = y;
+    e.time = profileNow();
+    q.tail.store(tail + 1, std::memory_order_release);
+}
+
+/* Consumer side: take the oldest event, false once the queue is empty */
+bool popInput (InputEvent &e)
+{
+    InputQueue &q = input_queue;
+    unsigned head = q.head.load(std::memory_order_relaxed);
+    if (head == q.tail.load(std::memory_order_acquire))
+        return false;
+    e = q.events[head & (INPUT_QUEUE_SIZE - 1)];
+    q.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void inputQueueReport ()
+{
+    if (input_queue.dropped)
+        printf("Input queue: %lld events dropped, queue full\n", input_queue.dropped);
+}
+
+/*************************
+ * Streaming level files *
+ *************************/
+
+/* A level file is a small header followed by brick spawn records sorted by y.
+   y is the distance (in world units) the bricks have to fall before the record
+   reaches the top of the screen, so it grows along the whole level. */
+#define LEVEL_MAGIC "BBLV"
+#define LEVEL_VERSION 1
+#define LEVEL_CHUNK_RECORDS 256   // records read by the loader thread in one go
+#define LEVEL_QUEUE_CHUNKS 4      // bounded prefetch queue, in chunks
+#define LEVEL_LOOKAHEAD 1.0f      // spawn records this far above the top edge
+#define LEVEL_PARKED_Y 1000000.0f // y of a brick slot that holds no brick
+
+enum { BRICK_BLACK = 0, BRICK_RED = 1, BRICK_GREEN = 2 };
+
+struct LevelHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned int count;
+};
+
+struct LevelRecord {
+    float x;
+    float y;
+    int kind;
+};
+
+struct LevelStream {
+    bool active;
+    FILE *file;
+    std::thread loader;
+    std::mutex lock;
+    std::condition_variable not_full;
+
+    // Ring of chunks filled by the loader thread and drained by the game
+    LevelRecord chunks[LEVEL_QUEUE_CHUNKS][LEVEL_CHUNK_RECORDS];
+    int chunk_size[LEVEL_QUEUE_CHUNKS];
+    int head, tail, queued;  // guarded by lock
+    bool eof, stop;          // guarded by lock
+
+    // Consumer side only
+    int current, cursor;     // chunk being drained and position inside it
+    bool finished;
+    float scroll;            // distance the level has fallen so far
+
+    // Instrumentation
+    unsigned int total, spawned, chunks_read, underruns, starved;
+    int peak_queued;
+    double read_time, worst_read, underrun_time, underrun_started;
+} level;
+
+/* Loader thread: keeps the prefetch queue topped up until the file runs out */
+void levelLoader ()
+{
+    profileThread("level loader");
+    for (;;) {
+        int slot;
+        {
+            std::unique_lock<std::mutex> guard(level.lock);
+            level.not_full.wait(guard, [] { return level.stop or level.queued < LEVEL_QUEUE_CHUNKS; });
+            if (level.stop)
+                return;
+            slot = level.tail;
+        }
+
+        // The slot is not visible to the game until queued is bumped, so read it unlocked
+        long long start = profileNow();
+        int got = fread(level.chunks[slot], sizeof(LevelRecord), LEVEL_CHUNK_RECORDS, level.file);
+        long long end = profileNow();
+        double took = (end - start) * 1e-9;
+        profileRecord("read level chunk", start, end);
+
+        std::lock_guard<std::mutex> guard(level.lock);
+        level.read_time += took;
+        if (took > level.worst_read) level.worst_read = took;
+        if (got > 0) {
+            level.chunk_size[slot] = got;
+            level.tail = (level.tail + 1) % LEVEL_QUEUE_CHUNKS;
+            level.queued++;
+            level.chunks_read++;
+            if (level.queued > level.peak_queued) level.peak_queued = level.queued;
+        }
+        if (got < LEVEL_CHUNK_RECORDS) {
+            level.eof = true;
+            return;
+        }
+    }
+}
+
+bool openLevel (const char *path)
+{
+    LevelHeader header;
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open level file %s\n", path);
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 or memcmp(header.magic, LEVEL_MAGIC, 4) != 0 or header.version != LEVEL_VERSION) {
+        fprintf(stderr, "%s is not a brick breaker level file\n", path);
+        fclose(file);
+        return false;
+    }
+
+    level.active = true;
+    level.file = file;
+    level.total = header.count;
+    level.current = -1;
+    level.loader = std::thread(levelLoader);
+    return true;
+}
+
+void closeLevel ()
+{
+    if (!level.active)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(level.lock);
+        level.stop = true;
+    }
+    level.not_full.notify_one();
+    level.loader.join();
+    fclose(level.file);
+
+    cout << "Level stream: " << level.spawned << "/" << level.total << " bricks spawned from " << level.chunks_read << " chunks" << endl;
+    cout << "\tread time " << level.read_time*1000 << " ms total, worst chunk " << level.worst_read*1000 << " ms" << endl;
+    cout << "\tpeak queue " << level.peak_queued << "/" << LEVEL_QUEUE_CHUNKS << " chunks, "
+         << level.underruns << " underruns (" << level.underrun_time*1000 << " ms waiting), "
+         << level.starved << " frames without a free brick slot" << endl;
+}
+
+/* Next record due for spawning, or NULL if none is available right now */
+LevelRecord* levelPeek ()
+{
+    if (level.current >= 0 and level.cursor < level.chunk_size[level.current])
+        return &level.chunks[level.current][level.cursor];
+
+    std::lock_guard<std::mutex> guard(level.lock);
+    if (level.current >= 0) {
+        // Hand the drained chunk back to the loader
+        level.head = (level.head + 1) % LEVEL_QUEUE_CHUNKS;
+        level.queued--;
+        level.current = -1;
+        level.not_full.notify_one();
+    }
+    if (level.queued == 0) {
+        if (level.eof) {
+            level.finished = true;
+        }
+        else if (level.underrun_started == 0) {
+            // The game caught up with the loader: a load hitch
+            level.underruns++;
+            level.underrun_started = hiresTime();
+        }
+        return NULL;
+    }
+    if (level.underrun_started != 0) {
+        double waited = hiresTime() - level.underrun_started;
+        level.underrun_time += waited;
+        level.underrun_started = 0;
+        long long now = profileNow();
+        profileRecord("level underrun", now - (long long)(waited * 1e9), now);
+    }
+    level.current = level.head;
+    level.cursor = 0;
+    return &level.chunks[level.current][0];
+}
+
+/* Find a parked slot for a new brick of the given colour */
+int freeBrickSlot (float *by, int last)
+{
+    for (int i = 0; i <= last; i++)
+        if (by[i] == LEVEL_PARKED_Y)
+            return i;
+    return -1;
+}
+
+/* Spawn every record that scrolled within LEVEL_LOOKAHEAD of the top edge */
+void levelSpawn ()
+{
+    LevelRecord *rec;
+    while ((rec = levelPeek()) != NULL and rec->y - level.scroll <= LEVEL_LOOKAHEAD) {
+        float *bx = tr_x, *by = tr_y;
+        int last = 1000;
+        if (rec->kind == BRICK_RED) { bx = rb_x; by = rb_y; last = 500; }
+        else if (rec->kind == BRICK_GREEN) { bx = gb_x; by = gb_y; last = 500; }
+
+        int slot = freeBrickSlot(by, last);
+        if (slot < 0) {
+            level.starved++;
+            break;
+        }
+        bx[slot] = rec->x;
+        by[slot] = 4.0f + rec->y - level.scroll;
+        markBrick(by, slot);
+        level.cursor++;
+        level.spawned++;
+    }
+}
+
+/* True once the whole level has been spawned and every brick has left the screen */
+bool levelComplete ()
+{
+    if (!level.active or !level.finished)
+        return false;
+    for (int i = 0; i <= 1000; i++)
+        if (tr_y[i] != LEVEL_PARKED_Y or (i <= 500 and (rb_y[i] != LEVEL_PARKED_Y or gb_y[i] != LEVEL_PARKED_Y)))
+            return false;
+    return true;
+}
+
+/* Write a random level of n bricks with the same spacing as the endless game */
+int makeLevel (const char *path, int n)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot create level file %s\n", path);
+        return 1;
+    }
+    LevelHeader header;
+    memcpy(header.magic, LEVEL_MAGIC, 4);
+    header.version = LEVEL_VERSION;
+    header.count = n;
+    fwrite(&header, sizeof(header), 1, file);
+
+    float y = 0;
+    for (int i = 0; i < n; i++) {
+        LevelRecord rec;
+        rec.x = -2 + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/4));
+        rec.y = y;
+        rec.kind = (i % 5 == 3) ? BRICK_RED : (i % 5 == 4) ? BRICK_GREEN : BRICK_BLACK;
+        fwrite(&rec, sizeof(rec), 1, file);
+        y += 1.5f + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/2));
+    }
+    fclose(file);
+    cout << "Wrote " << n << " bricks to " << path << endl;
+    return 0;
+}
+
+/* Send brick i of a colour back up once it is shot, collected or missed */
+void recycleBrick (float *by, int i, int last, float gap)
+{
+    // Streamed levels never reuse a brick, the slot just waits for the next record
+    if (level.active)
+        by[i] = LEVEL_PARKED_Y;
+    else
+        by[i] = by[last] + gap*i;
+    markBrick(by, i);
+}
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+
+/* Executed for character input (like in text boxes) */
+void keyboardChar (GLFWwindow* window, unsigned int key)
+{
+	switch (key) {
+		case 'Q':
+		case 'q':
+            quit(window);
+            break;
+		default:
+			break;
+	}
+}
+
+
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+	pushInput(INPUT_BUTTON, button, action, 0, 0);
+}
+
+void scroll (GLFWwindow* window, double xoffset, double yoffset)
+{
+	pushInput(INPUT_SCROLL, 0, 0, xoffset, yoffset);
+}
+
+void cursor_pos_callback(GLFWwindow* window, double xcoord, double ycoord)
+{
+	pushInput(INPUT_CURSOR, 0, 0, xcoord, ycoord);
+}
+
+
+/* Framebuffer size for the next recorded frame; the render backend applies it */
+int fb_width, fb_height;
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+     is different from WindowSize */
+    if (window) { // no window when headless
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    }
+
+	GLfloat fov = 90.0f;
+
+	// The viewport of openGL renderer is set by renderFrameGL, on the thread that owns the context
+	fb_width = fbwidth;
+	fb_height = fbheight;
+
+	// set the projection matrix as perspective
+	/* glMatrixMode (GL_PROJECTION);
 	   glLoadIdentity ();
 	   gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
 	// Store the projection matrix in a variable for future use
@@ -314,28 +1752,80 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
 }
 
-VAO *mirror,*triangle, *rectangle, *barside, *barfloor, *redbucket, *greenbucket, *redrectangle, *greenrectangle, *beam, *turret;
+VAO *mirror,*cannonfan, *rectangle, *barside, *barfloor, *redbucket, *greenbucket, *redrectangle, *greenrectangle, *beam, *turret;
 
-// Creates the triangle object used in this sample code
-void createTriangle ()
+/* The cannon's fan is one triangle repeated at fan_triangles rotations fan_step
+   apart. It never changes shape, so all copies are baked into one mesh that is
+   drawn with a single call and only rebuilt when these parameters change. */
+int fan_triangles = 300;
+float fan_step = 10*M_PI/1800.0f;
+
+struct FanMesh {
+  int triangles;
+  float step;
+} fan_built;
+
+/* Free an object made by create3DObject or createStreamObject */
+void delete3DObject (struct VAO* vao)
+{
+  if (vao->Mesh >= 0)
+  {
+    releaseMesh(vao->Mesh);
+    delete vao;
+    return;
+  }
+  if (render_state.vertex_array == vao->VertexArrayID)
+    render_state.vertex_array = (GLuint)-1; // GL unbinds a deleted VAO
+  glDeleteBuffers(1, &vao->VertexBuffer);
+  glDeleteBuffers(1, &vao->ColorBuffer);
+  glDeleteVertexArrays(1, &vao->VertexArrayID);
+  delete vao;
+}
+
+// Creates the cannon fan from copies of the sample code's triangle
+void createCannonFan ()
 {
   /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
 
   /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  static const GLfloat vertex_buffer_data [] = {
+  static const GLfloat triangle_vertices [] = {
     0, 0,0, // vertex 0
     0.25,0.433,0, // vertex 1
     0.5,0,0, // vertex 2
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0,0.5,1, // color 0
-    0,0.5,1, // color 1
-    0,0.5,1, // color 2
-  };
+  std::vector<GLfloat> vertex_buffer_data(9*fan_triangles);
+  for (int j = 0; j < fan_triangles; j++)
+  {
+    float c = cos(j*fan_step), s = sin(j*fan_step);
+    for (int v = 0; v < 3; v++)
+    {
+      const GLfloat *in = &triangle_vertices[3*v];
+      GLfloat *out = &vertex_buffer_data[9*j + 3*v];
+      out[0] = c*in[0] - s*in[1];
+      out[1] = s*in[0] + c*in[1];
+      out[2] = in[2];
+    }
+  }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+  if (cannonfan)
+  {
+    // Recorded frames hold the handle, so keep it and only swap its mesh
+    releaseMesh(cannonfan->Mesh);
+    cannonfan->Mesh = cannonfan->SortId = registerMesh(3*fan_triangles, &vertex_buffer_data[0]);
+  }
+  else
+    // create3DObject creates and returns a handle to a VAO that can be used later
+    cannonfan = create3DObject(GL_TRIANGLES, 3*fan_triangles, &vertex_buffer_data[0], 0, 0.5, 1, GL_LINE);
+  fan_built.triangles = fan_triangles;
+  fan_built.step = fan_step;
+}
+
+/* Rebuild the fan mesh if its parameters changed since it was baked */
+void updateCannonFan ()
+{
+  if (fan_built.triangles != fan_triangles or fan_built.step != fan_step)
+    createCannonFan();
 }
 
 // Creates the rectangle object used in this sample code
@@ -352,18 +1842,8 @@ void createRectangle ()
     -0.15,-0.3,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.2,0.2,0.2, // color 1
-    0.2,0.2,0.2, // color 2
-    0.2,0.2,0.2, // color 3
-
-    0.2,0.2,0.2, // color 3
-    0.2,0.2,0.2, // color 4
-    0.2,0.2,0.2  // color 1
-  };
-
   // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.2, 0.2, 0.2, GL_FILL);
 }
 
 void createRectangle_r ()
@@ -379,18 +1859,8 @@ void createRectangle_r ()
     -0.15,-0.3,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.8,0.1,0.1, // color 1
-    0.8,0.1,0.1, // color 2
-    0.8,0.1,0.1, // color 3
-
-    0.8,0.1,0.1, // color 3
-    0.8,0.1,0.1, // color 4
-    0.8,0.1,0.1  // color 1
-  };
-
   // create3DObject creates and returns a handle to a VAO that can be used later
-  redrectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  redrectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.8, 0.1, 0.1, GL_FILL);
 }
 
 void createRectangle_g ()
@@ -406,18 +1876,8 @@ void createRectangle_g ()
     -0.15,-0.3,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.1,0.8,0.1, // color 1
-    0.1,0.8,0.1, // color 2
-    0.1,0.8,0.1, // color 3
-
-    0.1,0.8,0.1, // color 3
-    0.1,0.8,0.1, // color 4
-    0.1,0.8,0.1  // color 1
-  };
-
   // create3DObject creates and returns a handle to a VAO that can be used later
-  greenrectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  greenrectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.1, 0.8, 0.1, GL_FILL);
 }
 void createfloor ()
 {
@@ -432,18 +1892,8 @@ void createfloor ()
     -4,-0.4,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.45,0.45,0.45, // color 1
-    0.45,0.45,0.45, // color 2
-    0.45,0.45,0.45, // color 3
-
-    0.45,0.45,0.45, // color 3
-    0.45,0.45,0.45, // color 4
-    0.45,0.45,0.45  // color 1
-  };
-
   // create3DObject creates and returns a handle to a VAO that can be used later
-  barfloor = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  barfloor = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.45, 0.45, 0.45, GL_FILL);
 }
 
 void createwall ()
@@ -459,18 +1909,8 @@ void createwall ()
     -0.4,-4,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.45,0.45,0.45, // color 1
-    0.45,0.45,0.45, // color 2
-    0.45,0.45,0.45, // color 3
-
-    0.45,0.45,0.45, // color 3
-    0.45,0.45,0.45, // color 4
-    0.45,0.45,0.45  // color 1
-  };
-
   // create3DObject creates and returns a handle to a VAO that can be used later
-  barside = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  barside = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.45, 0.45, 0.45, GL_FILL);
 }
 
 void createredbucket()
@@ -486,18 +1926,8 @@ void createredbucket()
     -0.38,-0.32,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.8,0.1,0.1,// color 1
-    0.8,0.1,0.1, // color 2
-    0.8,0.1,0.1, // color 3
-
-    0.8,0.1,0.1, // color 3
-    0.8,0.1,0.1, // color 4
-    0.8,0.1,0.1  // color 1
-  };
-
   // create3DObject creates and returns a handle to a VAO that can be used later
-  redbucket = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);	
+  redbucket = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.8, 0.1, 0.1, GL_FILL);	
 }
 
 void creategreenbucket()
@@ -513,99 +1943,1902 @@ void creategreenbucket()
     -0.38,-0.32,0  // vertex 1
   };
 
-  static const GLfloat color_buffer_data [] = {
-    0.1,0.8,0.1,// color 1
-    0.1,0.8,0.1, // color 2
-    0.1,0.8,0.1, // color 3
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  greenbucket = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.1, 0.8, 0.1, GL_FILL);	
+}
+
+void createbeam()
+{
+	// GL3 accepts only Triangles. Quads are not supported
+  static const GLfloat vertex_buffer_data [] = {
+    -0.18,-0.06,0, // vertex 1
+    0.18,-0.06,0, // vertex 2
+    0.18, 0.06,0, // vertex 3
+
+    0.18, 0.06,0, // vertex 3
+    -0.18, 0.06,0, // vertex 4
+    -0.18,-0.06,0  // vertex 1
+  };
+
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  beam = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.35, 0.75, 1, GL_FILL);	
+}
+
+void createturret()
+{
+	// GL3 accepts only Triangles. Quads are not supported
+  static const GLfloat vertex_buffer_data [] = {
+    -0.75,-0.09,0, // vertex 1
+    0.75,-0.09,0, // vertex 2
+    0.75, 0.09,0, // vertex 3
+
+    0.75, 0.09,0, // vertex 3
+    -0.75, 0.09,0, // vertex 4
+    -0.75,-0.09,0  // vertex 1
+  };
+
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  turret = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0, 0.5, 1, GL_FILL);	
+}
+
+void createmirror()
+{
+	// GL3 accepts only Triangles. Quads are not supported
+  static const GLfloat vertex_buffer_data [] = {
+    -0.7,-0.02,0, // vertex 1
+    0.7,-0.02,0, // vertex 2
+    0.7, 0.02,0, // vertex 3
 
-    0.1,0.8,0.1, // color 3
-    0.1,0.8,0.1, // color 4
-    0.1,0.8,0.1  // color 1
+    0.7, 0.02,0, // vertex 3
+    -0.7, 0.02,0, // vertex 4
+    -0.7,-0.02,0  // vertex 1
   };
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  greenbucket = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);	
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  mirror = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.7, 0.7, 0.7, GL_FILL);	
+}
+
+/***********************
+ * GPU brick animation *
+ ***********************/
+
+/* Bricks only ever fall, by the same distance each tick. Instead of sending
+   every brick's position every frame, each slot keeps the transform it had
+   when it (re)spawned plus the fall distance at that moment, and the vertex
+   shader subtracts that from the current fall distance in the "Frame" block.
+   The game marks a slot when it moves it some other way (spawned, recycled
+   or parked) and once more as it falls into view, which drops the float
+   rounding gathered on the way down. Each frame records only the marked
+   slots, and the renderer keeps the rest from earlier frames and uploads only
+   what changed. */
+#define BRICK_FALL_REBASE 1024.0       // keep the fall distance small enough for float precision
+#define BRICK_VIEW_TOP 4.3f            // bricks below this are on screen
+
+struct BrickInstance {
+    Instance2D spawn; // position, rotation and colour at spawn
+    GLfloat fall[2];  // fall distance at spawn, and 1 if the brick falls (0 when parked)
+};
+
+struct GPUBricks {
+    bool enabled;
+    // Game side
+    double fall, epoch;  // total fall distance, and where the shader's fall distance starts
+    float rebased;       // how far the epoch moved since the last recorded frame
+
+    // Renderer side, also used by the software backend
+    GLuint vertex_array, buffer;
+    BrickInstance slots[BRICK_SLOTS];
+    float angle;
+    int dirty_first, dirty_last;
+    long long uploads;   // slots uploaded since startup
+} gpu_bricks = { true };
+
+/* A slot the game moved since the last frame, and where it is now */
+struct BrickUpdate {
+    int slot;
+    float x, y;          // LEVEL_PARKED_Y when the slot is empty
+};
+
+/* The frame's brick changes; 'count' BrickUpdates follow */
+struct BricksCommand {
+    float angle;
+    float rebased;       // subtract from every slot's fall distance at spawn
+    int count;
+};
+
+/* The object a slot is drawn as, which gives its colour */
+VAO* brickObject (int slot)
+{
+    return slot < 1001 ? rectangle : slot < 1502 ? redrectangle : greenrectangle;
+}
+
+/* Let brick i fall by one tick's drop, marking it as it comes into view */
+void dropBrick (float *by, int i, float drop)
+{
+    if (by[i] == LEVEL_PARKED_Y)
+        return;
+    float y = by[i] - drop;
+    if (by[i] > BRICK_VIEW_TOP and y <= BRICK_VIEW_TOP)
+        markBrick(by, i);
+    by[i] = y;
+}
+
+/* Where the shader draws a slot: its spawn position moved down by the fall since */
+float brickShaderY (const BrickInstance &b, float fall)
+{
+    return b.spawn.y - b.fall[1] * (fall - b.fall[0]);
+}
+
+/* VAO drawing the brick mesh from the registry once per slot */
+void createGPUBricks ()
+{
+    GPUBricks &g = gpu_bricks;
+    glGenVertexArrays(1, &g.vertex_array);
+    glGenBuffers(1, &g.buffer);
+
+    bindVertexArray(g.vertex_array);
+    glcBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_registry.index_buffer);
+    bindArrayBuffer(mesh_registry.vertex_buffer);
+    glcVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)0);
+    glcEnableVertexAttribArray(0);
+
+    bindArrayBuffer(g.buffer);
+    glcBufferData(GL_ARRAY_BUFFER, sizeof(g.slots), NULL, GL_DYNAMIC_DRAW);
+    glcVertexAttribPointer(INSTANCE_ATTRIB, 4, GL_FLOAT, GL_FALSE, sizeof(BrickInstance), (void*)0);
+    glcVertexAttribPointer(COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BrickInstance), (void*)offsetof(Instance2D, color));
+    glcVertexAttribPointer(FALL_ATTRIB, 2, GL_FLOAT, GL_FALSE, sizeof(BrickInstance), (void*)offsetof(BrickInstance, fall));
+    glVertexAttribDivisor(INSTANCE_ATTRIB, 1);
+    glVertexAttribDivisor(COLOR_ATTRIB, 1);
+    glVertexAttribDivisor(FALL_ATTRIB, 1);
+    glcEnableVertexAttribArray(INSTANCE_ATTRIB);
+    glcEnableVertexAttribArray(COLOR_ATTRIB);
+    glcEnableVertexAttribArray(FALL_ATTRIB);
+
+    g.dirty_first = BRICK_SLOTS;
+    g.dirty_last = -1;
+}
+
+/* Advance the fall distance by one tick's drop */
+void advanceGPUBricks (float drop)
+{
+    gpu_bricks.fall += drop;
+}
+
+/* The shader's fall distance for this frame, restarted from 0 now and then */
+float gpuBricksFall ()
+{
+    GPUBricks &g = gpu_bricks;
+    if (g.fall - g.epoch > BRICK_FALL_REBASE) {
+        g.rebased += g.fall - g.epoch;
+        g.epoch = g.fall;
+    }
+    return g.fall - g.epoch;
+}
+
+/* Record the slots marked since the last frame. If the arena is full they
+   stay marked for the next one */
+void recordBricks (FrameArena &arena, float angle)
+{
+    GPUBricks &g = gpu_bricks;
+    BrickMarks &m = brick_marks;
+    BricksCommand *cmd = (BricksCommand*)recordCommand(arena, CMD_BRICKS, sizeof(BricksCommand) + m.count*sizeof(BrickUpdate));
+    if (!cmd)
+        return;
+    cmd->angle = angle;
+    cmd->rebased = g.rebased;
+    cmd->count = m.count;
+    BrickUpdate *update = (BrickUpdate*)(cmd + 1);
+    for (int k = 0; k < m.count; k++) {
+        int slot = m.pending[k], i = slot;
+        const float *bx = tr_x, *by = tr_y;
+        if (slot >= 1502) { bx = gb_x; by = gb_y; i = slot - 1502; }
+        else if (slot >= 1001) { bx = rb_x; by = rb_y; i = slot - 1001; }
+        update[k].slot = slot;
+        update[k].x = bx[i];
+        update[k].y = by[i];
+        m.marked[slot] = false;
+    }
+    m.count = 0;
+    g.rebased = 0;
+}
+
+/* Mark slot i for upload */
+void dirtyBrick (int i)
+{
+    GPUBricks &g = gpu_bricks;
+    g.dirty_first = min(g.dirty_first, i);
+    g.dirty_last = max(g.dirty_last, i);
+}
+
+/* Bring the renderer's slots up to date with a recorded frame */
+void applyBrickUpdates (const BricksCommand &bricks, float fall)
+{
+    GPUBricks &g = gpu_bricks;
+    if (bricks.rebased != 0 or bricks.angle != g.angle) {
+        // The shader's fall distance restarted from 0, or every brick turned
+        for (int i = 0; i < BRICK_SLOTS; i++) {
+            g.slots[i].fall[0] -= bricks.rebased;
+            g.slots[i].spawn.angle = bricks.angle;
+        }
+        g.angle = bricks.angle;
+        dirtyBrick(0);
+        dirtyBrick(BRICK_SLOTS - 1);
+    }
+    const BrickUpdate *update = (const BrickUpdate*)(&bricks + 1);
+    for (int k = 0; k < bricks.count; k++) {
+        BrickInstance &b = g.slots[update[k].slot];
+        b.spawn.x = update[k].x;
+        b.spawn.y = update[k].y;
+        b.spawn.angle = bricks.angle;
+        b.spawn.scale = 1;
+        memcpy(b.spawn.color, brickObject(update[k].slot)->Color, sizeof(b.spawn.color));
+        b.fall[0] = fall;
+        b.fall[1] = update[k].y == LEVEL_PARKED_Y ? 0 : 1; // parked slots stay far off screen
+        dirtyBrick(update[k].slot);
+    }
+}
+
+/* Draw every brick in one call, uploading only the slots that changed */
+void drawGPUBricks ()
+{
+    GPUBricks &g = gpu_bricks;
+    if (g.dirty_first <= g.dirty_last) {
+        bindArrayBuffer(g.buffer);
+        glcBufferSubData(GL_ARRAY_BUFFER, g.dirty_first*sizeof(BrickInstance), (g.dirty_last - g.dirty_first + 1)*sizeof(BrickInstance), &g.slots[g.dirty_first]);
+        g.uploads += g.dirty_last - g.dirty_first + 1;
+        g.dirty_first = BRICK_SLOTS;
+        g.dirty_last = -1;
+    }
+
+    uploadMeshes();
+    const Mesh &mesh = mesh_registry.meshes[rectangle->Mesh];
+    setFillMode(rectangle->FillMode);
+    bindVertexArray(g.vertex_array);
+    glcDrawElementsInstancedBaseVertex(rectangle->PrimitiveMode, mesh.indices.size(), GL_UNSIGNED_SHORT,
+                                       (void*)(mesh.first_index*sizeof(GLushort)), BRICK_SLOTS, mesh.base_vertex);
+}
+
+/***********************
+ * Performance overlay *
+ ***********************/
+
+/* The HUD is rebuilt on the CPU every frame as plain coloured triangles in
+   clip space and drawn with the game's shader in a single call. Numbers use
+   seven-segment digits, so no font texture is needed. */
+#define HUD_MAX_VERTICES 8192
+#define HUD_HISTORY 240        // frames shown in the frame time graph
+#define HUD_GRAPH_MS 33.3f     // frame time at the top of the graph
+
+struct HUD {
+    bool visible;
+    VAO *vao;
+    StreamVertex vertices[HUD_MAX_VERTICES];
+    int count;
+    StreamBuffer stream;
+
+    float history[HUD_HISTORY];
+    int history_pos;
+
+    // Figures of the last completed frame, filled in by the main loop
+    float frame_ms, tick_ms;
+    GLStats gl;
+    int bricks, beams;
+    float gpu_ms[GPU_PASSES];
+} hud;
+
+void hudQuad (float x0, float y0, float x1, float y1, float r, float g, float b)
+{
+    if (hud.count + 6 > HUD_MAX_VERTICES)
+        return;
+    const float corners[6][2] = { {x0,y0}, {x1,y0}, {x1,y1}, {x1,y1}, {x0,y1}, {x0,y0} };
+    for (int i = 0; i < 6; i++) {
+        StreamVertex &v = hud.vertices[hud.count];
+        v.x = (GLshort)lround(max(-1.0f, min(corners[i][0], 1.0f)) * 32767);
+        v.y = (GLshort)lround(max(-1.0f, min(corners[i][1], 1.0f)) * 32767);
+        v.color[0] = (GLubyte)lround(r*255);
+        v.color[1] = (GLubyte)lround(g*255);
+        v.color[2] = (GLubyte)lround(b*255);
+        v.color[3] = 255;
+        hud.count++;
+    }
+}
+
+/* Seven segment digit of height 2*size with its lower left corner at x,y */
+void hudDigit (float x, float y, float size, int digit, float r, float g, float b)
+{
+    // Segments a..g as bits 0..6
+    static const int masks[10] = { 0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F };
+    static const float segments[7][4] = {
+        {0, 1.8f, 1, 2}, {0.8f, 1, 1, 2}, {0.8f, 0, 1, 1}, {0, 0, 1, 0.2f},
+        {0, 0, 0.2f, 1}, {0, 1, 0.2f, 2}, {0, 0.9f, 1, 1.1f}
+    };
+    for (int s = 0; s < 7; s++)
+        if (masks[digit] & (1 << s))
+            hudQuad(x + segments[s][0]*size, y + segments[s][1]*size, x + segments[s][2]*size, y + segments[s][3]*size, r, g, b);
+}
+
+/* Right-aligned number ending at x, with the given count of decimals */
+void hudNumber (float x, float y, float size, float value, int decimals, float r, float g, float b)
+{
+    float advance = 1.4f * size;
+    long n = lround(fabs(value) * pow(10, decimals));
+    for (int d = 0; d == 0 or n > 0 or d <= decimals; d++) {
+        if (d == decimals and decimals > 0) {
+            x -= 0.5f * size;
+            hudQuad(x + 0.1f*size, y, x + 0.3f*size, y + 0.2f*size, r, g, b);
+        }
+        x -= advance;
+        hudDigit(x, y, size, n % 10, r, g, b);
+        n /= 10;
+    }
+}
+
+void createHUD ()
+{
+    // Drawn on its own, not through the render queue
+    hud.vao = createStreamObject(hud.stream, GL_TRIANGLES, HUD_MAX_VERTICES, GL_FILL);
+}
+
+void hudPushFrame (float frame_ms)
+{
+    hud.history[hud.history_pos] = frame_ms;
+    hud.history_pos = (hud.history_pos + 1) % HUD_HISTORY;
+}
+
+void hudBuild ()
+{
+    const float left = -0.98f, top = 0.98f, bar = 0.004f, graph_h = 0.25f;
+    const float size = 0.025f, row = 0.075f;
+    hud.count = 0;
+
+    // Panel and graph, with a line at 60 fps
+    hudQuad(left, top - 0.62f, left + HUD_HISTORY*bar + 0.02f, top, 0.1f, 0.1f, 0.12f);
+    float base = top - 0.6f;
+    hudQuad(left + 0.01f, base + graph_h*16.7f/HUD_GRAPH_MS, left + 0.01f + HUD_HISTORY*bar, base + graph_h*16.7f/HUD_GRAPH_MS + 0.003f, 0.4f, 0.4f, 0.4f);
+    for (int i = 0; i < HUD_HISTORY; i++) {
+        float ms = hud.history[(hud.history_pos + i) % HUD_HISTORY];
+        float h = graph_h * min(ms / HUD_GRAPH_MS, 1.0f);
+        float x = left + 0.01f + i*bar;
+        if (ms < 17)
+            hudQuad(x, base, x + bar, base + h, 0.2f, 0.8f, 0.2f);
+        else if (ms < 34)
+            hudQuad(x, base, x + bar, base + h, 0.9f, 0.8f, 0.1f);
+        else
+            hudQuad(x, base, x + bar, base + h, 0.9f, 0.2f, 0.1f);
+    }
+
+    // Three columns of figures, each tagged with a coloured swatch
+    const float figures[9] = { hud.frame_ms > 0 ? 1000 / hud.frame_ms : 0, hud.frame_ms, hud.tick_ms,
+                               (float)hud.gl.draw_calls, (float)hud.gl.binds, (float)hud.gl.uniform_uploads,
+                               hud.gl.bytes_uploaded / 1024.0f, (float)hud.bricks, (float)hud.beams };
+    const int decimals[9] = { 0, 2, 2, 0, 0, 0, 1, 0, 0 };
+    const float swatch[9][3] = { {1,1,1}, {0.2f,0.8f,0.2f}, {1,0.6f,0.1f},
+                                 {0.3f,0.9f,0.9f}, {0.9f,0.3f,0.9f}, {1,1,0.3f},
+                                 {0.9f,0.3f,0.3f}, {0.6f,0.6f,0.6f}, {0.35f,0.75f,1} };
+    for (int f = 0; f < 9; f++) {
+        float y = top - 0.06f - (f % 3)*row;
+        float x = left + 0.02f + (f / 3)*0.33f;
+        hudQuad(x, y, x + 0.04f, y + 2*size, swatch[f][0], swatch[f][1], swatch[f][2]);
+        hudNumber(x + 0.3f, y, size, figures[f], decimals[f], 1, 1, 1);
+    }
+
+    // GPU time per pass as one stacked bar, full width at 60 fps, and its total
+    const float pass_colors[GPU_PASSES][3] = { {0.6f,0.6f,0.6f}, {0.9f,0.9f,0.9f}, {0.9f,0.3f,0.3f},
+                                               {0.2f,0.5f,1}, {0.3f,0.8f,0.3f}, {1,0.6f,0.1f} };
+    float x = left + 0.02f, y = top - 0.29f, total = 0;
+    for (int p = 0; p < GPU_PASSES; p++) {
+        float w = 0.64f * hud.gpu_ms[p] / 16.7f;
+        hudQuad(x, y, min(x + w, left + 0.66f), y + 2*size, pass_colors[p][0], pass_colors[p][1], pass_colors[p][2]);
+        x = min(x + w, left + 0.66f);
+        total += hud.gpu_ms[p];
+    }
+    hudNumber(left + 0.96f, y, size, total, 2, 1, 1, 1);
+}
+
+/* Build the overlay and record its vertices */
+void recordHUD (FrameArena &arena)
+{
+    hudBuild();
+    int *cmd = (int*)recordCommand(arena, CMD_HUD, COMMAND_ALIGN + hud.count*sizeof(StreamVertex));
+    if (!cmd)
+        return;
+    cmd[0] = hud.count; // then the vertices
+    memcpy((char*)cmd + COMMAND_ALIGN, hud.vertices, hud.count*sizeof(StreamVertex));
+}
+
+/* Draw the recorded overlay in one call; expects the game's program to be in use */
+void drawHUD (const int *cmd)
+{
+    int count = cmd[0];
+    GLintptr offset = streamWrite(hud.stream, (const char*)cmd + COMMAND_ALIGN, count*sizeof(StreamVertex));
+
+    // Vertices are already in clip space, and with its instance array disabled
+    // the transform attribute keeps the identity set in initGL
+    bindFrameUniforms(true);
+    hud.vao->NumVertices = count;
+    // Positions carry no depth, so keep the overlay on top by not testing it
+    GL_COUNT(state_changes, 2);
+    glDisable(GL_DEPTH_TEST);
+    draw3DObject(hud.vao, offset / sizeof(StreamVertex));
+    glEnable(GL_DEPTH_TEST);
+}
+
+/**********************
+ * Headless rendering *
+ **********************/
+
+/* With --headless, there is no window: a surfaceless EGL context on whatever
+   driver is present (Mesa's llvmpipe on a machine without a GPU) renders the
+   same frames into an offscreen framebuffer. The game runs a fixed number of
+   frames with no input, which is enough for render benchmarks on servers. */
+struct Headless {
+    bool enabled;
+    int frames;          // frames left to render, here or with --software
+    GLuint framebuffer, color, depth;
+#ifdef HAVE_EGL
+    EGLDisplay display;
+    EGLContext context;
+#endif
+} headless;
+
+/* Create the context and the framebuffer to draw into instead of a window */
+bool initHeadless (int width, int height)
+{
+#ifdef HAVE_EGL
+    Headless &h = headless;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    h.display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : EGL_NO_DISPLAY;
+    if (h.display == EGL_NO_DISPLAY)
+        h.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (!eglInitialize(h.display, &major, &minor)) {
+        cout << "Headless: cannot initialize EGL" << endl;
+        return false;
+    }
+
+    const EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    eglBindAPI(EGL_OPENGL_API);
+    if (!eglChooseConfig(h.display, config_attribs, &config, 1, &configs) or configs == 0
+        or (h.context = eglCreateContext(h.display, config, EGL_NO_CONTEXT, context_attribs)) == EGL_NO_CONTEXT
+        or !eglMakeCurrent(h.display, EGL_NO_SURFACE, EGL_NO_SURFACE, h.context)) {
+        cout << "Headless: cannot create a surfaceless OpenGL 3.3 context" << endl;
+        return false;
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // Same attachments a window would have: colour and depth
+    glGenFramebuffers(1, &h.framebuffer);
+    glGenRenderbuffers(1, &h.color);
+    glGenRenderbuffers(1, &h.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, h.color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, h.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, h.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, h.color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, h.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cout << "Headless: offscreen framebuffer incomplete" << endl;
+        return false;
+    }
+    scene_framebuffer = h.framebuffer;
+    cout << "Headless: EGL " << major << "." << minor << ", rendering " << width << "x" << height << " offscreen" << endl;
+    return true;
+#else
+    cout << "Headless rendering needs EGL: build with make HEADLESS=1" << endl;
+    return false;
+#endif
+}
+
+/* Make the game's GL context current on the calling thread, or release it */
+void makeContextCurrent (GLFWwindow *window, bool current)
+{
+    if (!window and !headless.enabled)
+        return; // software rendering, there is no context
+#ifdef HAVE_EGL
+    if (headless.enabled) {
+        eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? headless.context : EGL_NO_CONTEXT);
+        return;
+    }
+#endif
+    glfwMakeContextCurrent(current ? window : NULL);
+}
+
+/* Show the finished frame; offscreen, wait for it so frame times include the GPU */
+void presentFrameGL (GLFWwindow *window)
+{
+    if (headless.enabled)
+        glFinish();
+    else
+        glfwSwapBuffers(window);
+}
+
+/* Read back what the frame drew, before it is swapped away */
+bool readFrameGL (std::vector<unsigned int> &pixels, int &width, int &height)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    width = viewport[2];
+    height = viewport[3];
+    pixels.resize(width*height);
+    glcBindFramebuffer(GL_READ_FRAMEBUFFER, scene_framebuffer);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+    // GL rows start at the bottom
+    for (int y = 0; y < height / 2; y++)
+        std::swap_ranges(&pixels[y*width], &pixels[(y + 1)*width], &pixels[(height - 1 - y)*width]);
+    return true;
+}
+
+void closeHeadless ()
+{
+#ifdef HAVE_EGL
+    if (!headless.enabled)
+        return;
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+#endif
+}
+
+/*****************
+ * Frame capture *
+ *****************/
+
+/* --capture records every frame without stalling the game. Each frame is
+   read into one of CAPTURE_PBOS pixel buffer objects; the copy runs on the
+   GPU, and the buffer is only mapped when its turn comes round again, a few
+   frames later. Its pixels go into a free slot of a small queue for a writer
+   thread, which converts and writes them out. If the GPU has not finished a
+   readback by then, or the writer has fallen behind and no slot is free,
+   the frame is dropped and counted rather than waited for.
+
+   A path ending in .y4m gets raw YUV4MPEG2 video (4:4:4, 60 fps); any other
+   path is a directory that gets a PNG sequence. The PNGs are stored without
+   compression, so writing them costs little more than the copy. */
+#define CAPTURE_PBOS 3     // frames between a readback and its map
+#define CAPTURE_QUEUE 8    // frames waiting for the writer
+
+struct CaptureBuffer {
+    std::vector<unsigned char> pixels;   // RGBA8, bottom row first as GL reads them
+    int width, height;
+    long long frame;
+};
+
+struct Capture {
+    bool enabled, y4m;
+    const char *path;
+
+    // Render thread side
+    GLuint pbos[CAPTURE_PBOS];
+    GLsync fences[CAPTURE_PBOS];
+    long long pbo_frames[CAPTURE_PBOS];  // frame number each buffer holds
+    int pbo_width, pbo_height;           // size the buffers were allocated for
+    int next;                            // buffer to read the next frame into
+    long long frames;                    // frames read back
+    long long gpu_drops;                 // readback not finished when mapped
+    long long queue_drops;               // no free slot for the writer
+
+    // Shared with the writer
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable changed;
+    CaptureBuffer buffers[CAPTURE_QUEUE];
+    int queued[CAPTURE_QUEUE], queue_head, queue_count;
+    std::vector<int> free_buffers;
+    bool stop;
+
+    // Writer side
+    FILE *file;                          // the video, with y4m
+    int video_width, video_height;
+    long long written, size_drops;       // size_drops: frames of another size than the video
+} capture;
+
+/* Uncompressed PNG of RGBA8 pixels stored bottom row first; alpha is dropped */
+bool writePNG (const char *path, const unsigned char *pixels, int width, int height)
+{
+    static unsigned int crc_table[256];
+    if (!crc_table[1])
+        for (unsigned int n = 0; n < 256; n++) {
+            unsigned int c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc_table[n] = c;
+        }
+
+    // Filter byte 0 and RGB for every row, top first
+    std::vector<unsigned char> raw;
+    raw.reserve(height*(1 + 3*width));
+    for (int y = height - 1; y >= 0; y--) {
+        raw.push_back(0);
+        const unsigned char *p = pixels + y*width*4;
+        for (int x = 0; x < width; x++, p += 4)
+            raw.insert(raw.end(), p, p + 3);
+    }
+
+    // zlib stream of stored deflate blocks
+    std::vector<unsigned char> idat;
+    idat.push_back(0x78);
+    idat.push_back(0x01);
+    unsigned int a = 1, b = 0;
+    for (size_t at = 0; at < raw.size(); ) {
+        size_t n = min(raw.size() - at, (size_t)65535);
+        idat.push_back(at + n == raw.size());
+        unsigned char header[4] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)~n, (unsigned char)(~n >> 8) };
+        idat.insert(idat.end(), header, header + 4);
+        idat.insert(idat.end(), raw.begin() + at, raw.begin() + at + n);
+        for (size_t i = at; i < at + n; i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        at += n;
+    }
+    unsigned int adler = b << 16 | a;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        idat.push_back(adler >> shift);
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+    unsigned char ihdr[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+                               (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+                               8, 2, 0, 0, 0 };
+    const unsigned char *chunks[3] = { ihdr, idat.empty() ? NULL : &idat[0], NULL };
+    const size_t sizes[3] = { sizeof(ihdr), idat.size(), 0 };
+    const char *types[3] = { "IHDR", "IDAT", "IEND" };
+    for (int c = 0; c < 3; c++) {
+        unsigned char length[4] = { (unsigned char)(sizes[c] >> 24), (unsigned char)(sizes[c] >> 16), (unsigned char)(sizes[c] >> 8), (unsigned char)sizes[c] };
+        fwrite(length, 1, 4, file);
+        fwrite(types[c], 1, 4, file);
+        if (sizes[c])
+            fwrite(chunks[c], 1, sizes[c], file);
+        unsigned int crc = 0xffffffffu;
+        for (int i = 0; i < 4; i++)
+            crc = crc_table[(crc ^ types[c][i]) & 0xff] ^ (crc >> 8);
+        for (size_t i = 0; i < sizes[c]; i++)
+            crc = crc_table[(crc ^ chunks[c][i]) & 0xff] ^ (crc >> 8);
+        crc ^= 0xffffffffu;
+        unsigned char crc_bytes[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+        fwrite(crc_bytes, 1, 4, file);
+    }
+    return fclose(file) == 0;
+}
+
+/* Append a frame to the video as BT.601 studio range Y, Cb and Cr planes */
+bool writeY4MFrame (const CaptureBuffer &frame)
+{
+    Capture &c = capture;
+    if (!c.file) {
+        c.file = fopen(c.path, "wb");
+        if (!c.file)
+            return false;
+        c.video_width = frame.width;
+        c.video_height = frame.height;
+        fprintf(c.file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n", frame.width, frame.height);
+    }
+    if (frame.width != c.video_width or frame.height != c.video_height) {
+        c.size_drops++;
+        return true;
+    }
+    int w = frame.width, h = frame.height;
+    std::vector<unsigned char> planes(3*w*h);
+    for (int y = 0; y < h; y++) {
+        const unsigned char *p = &frame.pixels[(h - 1 - y)*w*4];
+        for (int x = 0; x < w; x++, p += 4) {
+            int r = p[0], g = p[1], b = p[2], i = y*w + x;
+            planes[i] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+            planes[w*h + i] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+            planes[2*w*h + i] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+        }
+    }
+    fputs("FRAME\n", c.file);
+    return fwrite(&planes[0], 1, planes.size(), c.file) == planes.size();
+}
+
+/* Body of the writer thread: write queued frames until told to stop and the queue is empty */
+void captureWriter ()
+{
+    Capture &c = capture;
+    profileThread("capture writer");
+    std::unique_lock<std::mutex> guard(c.lock);
+    while (true) {
+        c.changed.wait(guard, [&c] { return c.stop or c.queue_count > 0; });
+        if (c.queue_count == 0)
+            break;
+        int slot = c.queued[c.queue_head];
+        c.queue_head = (c.queue_head + 1) % CAPTURE_QUEUE;
+        c.queue_count--;
+        guard.unlock();
+
+        CaptureBuffer &frame = c.buffers[slot];
+        bool ok;
+        {
+            PROFILE_SCOPE("write frame");
+            if (c.y4m)
+                ok = writeY4MFrame(frame);
+            else {
+                char path[1024];
+                snprintf(path, sizeof(path), "%s/frame_%06lld.png", c.path, frame.frame);
+                ok = writePNG(path, &frame.pixels[0], frame.width, frame.height);
+            }
+        }
+        if (!ok)
+            cout << "Capture: cannot write to " << c.path << endl;
+        else
+            c.written++;
+
+        guard.lock();
+        c.free_buffers.push_back(slot);
+    }
+}
+
+bool openCapture ()
+{
+    Capture &c = capture;
+    size_t length = strlen(c.path);
+    c.y4m = length > 4 and !strcmp(c.path + length - 4, ".y4m");
+    if (!c.y4m)
+        mkdir(c.path, 0755); // fine if it exists
+    for (int i = 0; i < CAPTURE_QUEUE; i++)
+        c.free_buffers.push_back(i);
+    c.writer = std::thread(captureWriter);
+    return true;
+}
+
+/* Hand a mapped readback to the writer, or drop it if the writer has no room */
+void queueCapture (const unsigned char *pixels, int width, int height, long long number)
+{
+    Capture &c = capture;
+    int slot;
+    {
+        std::lock_guard<std::mutex> guard(c.lock);
+        if (c.free_buffers.empty()) {
+            c.queue_drops++;
+            return;
+        }
+        slot = c.free_buffers.back();
+        c.free_buffers.pop_back();
+    }
+    CaptureBuffer &frame = c.buffers[slot];
+    frame.pixels.assign(pixels, pixels + width*height*4);
+    frame.width = width;
+    frame.height = height;
+    frame.frame = number;
+    {
+        std::lock_guard<std::mutex> guard(c.lock);
+        c.queued[(c.queue_head + c.queue_count) % CAPTURE_QUEUE] = slot;
+        c.queue_count++;
+    }
+    c.changed.notify_all();
+}
+
+/* Map the readback in buffer i if the GPU is done with it, and queue it */
+void collectCapture (int i, bool wait)
+{
+    Capture &c = capture;
+    if (!c.fences[i])
+        return;
+    GLenum status = glClientWaitSync(c.fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+    glDeleteSync(c.fences[i]);
+    c.fences[i] = 0;
+    if (status == GL_TIMEOUT_EXPIRED or status == GL_WAIT_FAILED) {
+        c.gpu_drops++;
+        return;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbos[i]);
+    const unsigned char *pixels = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, c.pbo_width*c.pbo_height*4, GL_MAP_READ_BIT);
+    if (pixels) {
+        queueCapture(pixels, c.pbo_width, c.pbo_height, c.pbo_frames[i]);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    else
+        c.gpu_drops++;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/* Start reading back the finished frame; expects it in scene_framebuffer */
+void captureFrameGL (int width, int height)
+{
+    Capture &c = capture;
+    if (!c.pbos[0])
+        glGenBuffers(CAPTURE_PBOS, c.pbos);
+    if (width != c.pbo_width or height != c.pbo_height) {
+        // Readbacks in flight have the old size; finish them first
+        for (int i = 0; i < CAPTURE_PBOS; i++)
+            collectCapture((c.next + i) % CAPTURE_PBOS, true);
+        for (int i = 0; i < CAPTURE_PBOS; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, width*height*4, NULL, GL_STREAM_READ);
+        }
+        c.pbo_width = width;
+        c.pbo_height = height;
+    }
+
+    // This buffer's last readback was CAPTURE_PBOS frames ago
+    int i = c.next;
+    collectCapture(i, false);
+
+    glcBindFramebuffer(GL_READ_FRAMEBUFFER, scene_framebuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, c.pbos[i]);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    c.fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    c.pbo_frames[i] = ++c.frames;
+    c.next = (i + 1) % CAPTURE_PBOS;
+    profileCounter("capture drops", c.gpu_drops + c.queue_drops);
+}
+
+/* Collect the readbacks still in flight; needs the GL context */
+void drainCapture ()
+{
+    Capture &c = capture;
+    if (!c.enabled)
+        return;
+    for (int i = 0; i < CAPTURE_PBOS; i++)
+        collectCapture((c.next + i) % CAPTURE_PBOS, true);
+}
+
+void closeCapture ()
+{
+    Capture &c = capture;
+    if (!c.enabled)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(c.lock);
+        c.stop = true;
+    }
+    c.changed.notify_all();
+    c.writer.join();
+    if (c.file)
+        fclose(c.file);
+    cout << "Capture: " << c.written << " of " << c.frames << " frames written to " << c.path << ", "
+         << c.gpu_drops + c.queue_drops + c.size_drops << " dropped (" << c.gpu_drops << " readbacks not ready, "
+         << c.queue_drops << " with the writer behind, " << c.size_drops << " after a resize)" << endl;
+}
+
+/***********************
+ * Software rasterizer *
+ ***********************/
+
+/* With --software, no GL is used at all: recorded frames are replayed on the
+   CPU into a memory buffer, for image output and visual tests on machines
+   without any GL driver. Every mesh is flat coloured, so only coverage is
+   needed: triangles are binned into screen tiles in draw order, then the
+   tiles are filled in parallel, four pixels at a time with SSE2. Later
+   triangles overwrite earlier ones, in the same order the GL path draws. */
+#define SOFT_TILE 64
+#define SOFT_CLEAR 0x00ffffffu    // white, alpha 0, as glClearColor in initGL
+#define SOFTWARE_FRAME_FILE "brickbreaker_frame.ppm"
+
+struct SoftTriangle {
+    float x[3], y[3];             // pixels, from the top left corner
+    unsigned int color;           // RGBA8, red in the low byte
+    bool outline;                 // GL_LINE fill mode: edges only
+};
+
+struct SoftRaster {
+    bool enabled;
+    int width, height, tiles_x, tiles_y;
+    std::vector<unsigned int> pixels;     // the frame, top row first
+    std::vector<SoftTriangle> triangles;  // this frame's, in draw order
+    std::vector< std::vector<int> > bins; // triangles touching each tile, in draw order
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable changed;
+    int generation;               // bumped to start the workers on a frame
+    int busy;                     // workers not done with the current frame
+    bool stop;
+    std::atomic<int> next_tile;
+    long long triangles_drawn;
+} software;
+
+inline unsigned int softColor (const GLubyte color[4])
+{
+    return color[0] | color[1] << 8 | color[2] << 16 | 0xffu << 24;
+}
+
+/* Queue one clip space triangle, binned into every tile its bounds touch */
+void softTriangle (const glm::vec4 clip[3], unsigned int color, bool outline)
+{
+    SoftRaster &r = software;
+    SoftTriangle t;
+    float min_x = 1e30f, min_y = 1e30f, max_x = -1e30f, max_y = -1e30f;
+    for (int v = 0; v < 3; v++) {
+        t.x[v] = (clip[v].x / clip[v].w + 1) * 0.5f * r.width;
+        t.y[v] = (1 - clip[v].y / clip[v].w) * 0.5f * r.height;
+        min_x = min(min_x, t.x[v]);
+        max_x = max(max_x, t.x[v]);
+        min_y = min(min_y, t.y[v]);
+        max_y = max(max_y, t.y[v]);
+    }
+    if (max_x < 0 or max_y < 0 or min_x >= r.width or min_y >= r.height)
+        return;
+    t.color = color;
+    t.outline = outline;
+
+    int index = r.triangles.size();
+    r.triangles.push_back(t);
+    int tx0 = (int)max(0.0f, min_x) / SOFT_TILE, tx1 = (int)min(r.width - 1.0f, max_x) / SOFT_TILE;
+    int ty0 = (int)max(0.0f, min_y) / SOFT_TILE, ty1 = (int)min(r.height - 1.0f, max_y) / SOFT_TILE;
+    for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++)
+            r.bins[ty*r.tiles_x + tx].push_back(index);
+}
+
+/* Transform an object's mesh the way the vertex shader does and queue its triangles */
+void softDraw (const glm::mat4 &VP, const VAO *vao, const Instance2D &instance)
+{
+    const Mesh &mesh = mesh_registry.meshes[vao->Mesh];
+    float c = cosf(instance.angle), s = sinf(instance.angle);
+    unsigned int color = softColor(instance.color);
+    glm::vec4 clip[3];
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        for (int v = 0; v < 3; v++) {
+            const MeshVertex &p = mesh.vertices[mesh.indices[i + v]];
+            float x = instance.scale*p.x, y = instance.scale*p.y;
+            clip[v] = VP * glm::vec4(c*x - s*y + instance.x, s*x + c*y + instance.y, 0, 1);
+        }
+        softTriangle(clip, color, vao->FillMode == GL_LINE);
+    }
+}
+
+/* Queue the recorded overlay; its vertices are already in clip space */
+void softHUD (const int *cmd)
+{
+    const StreamVertex *vertices = (const StreamVertex*)((const char*)cmd + COMMAND_ALIGN);
+    glm::vec4 clip[3];
+    for (int i = 0; i + 2 < cmd[0]; i += 3) {
+        for (int v = 0; v < 3; v++)
+            clip[v] = glm::vec4(vertices[i + v].x / 32767.0f, vertices[i + v].y / 32767.0f, 0, 1);
+        softTriangle(clip, softColor(vertices[i].color), false);
+    }
+}
+
+/* Fill the part of a triangle inside a tile: the pixels whose centres are on
+   the inner side of all three edges */
+void softFill (const SoftTriangle &t, int x0, int y0, int x1, int y1)
+{
+    SoftRaster &r = software;
+    float area = (t.x[1] - t.x[0])*(t.y[2] - t.y[0]) - (t.y[1] - t.y[0])*(t.x[2] - t.x[0]);
+    if (area == 0)
+        return;
+    // Edge i is a*x + b*y + c, signed so the inside is positive whichever way the triangle winds
+    float sign = area > 0 ? 1 : -1, a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        a[i] = sign * (t.y[i] - t.y[j]);
+        b[i] = sign * (t.x[j] - t.x[i]);
+        c[i] = -(a[i]*t.x[i] + b[i]*t.y[i]);
+    }
+    // Clamp to the tile before converting, the bounds can be far off screen
+    x0 = (int)max((float)x0, min(t.x[0], min(t.x[1], t.x[2])));
+    x1 = (int)min((float)x1, max(t.x[0], max(t.x[1], t.x[2])) + 1);
+    y0 = (int)max((float)y0, min(t.y[0], min(t.y[1], t.y[2])));
+    y1 = (int)min((float)y1, max(t.y[0], max(t.y[1], t.y[2])) + 1);
+
+    for (int y = y0; y < y1; y++) {
+        unsigned int *row = &r.pixels[y*r.width];
+        float py = y + 0.5f;
+        float e0 = b[0]*py + c[0], e1 = b[1]*py + c[1], e2 = b[2]*py + c[2];
+        int x = x0;
+#ifdef __SSE2__
+        const __m128 zero = _mm_setzero_ps(), four = _mm_set1_ps(4);
+        const __m128i color = _mm_set1_epi32(t.color);
+        __m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+        for (; x + 4 <= x1; x += 4, px = _mm_add_ps(px, four)) {
+            __m128 in0 = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), px), _mm_set1_ps(e0)), zero);
+            __m128 in1 = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[1]), px), _mm_set1_ps(e1)), zero);
+            __m128 in2 = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[2]), px), _mm_set1_ps(e2)), zero);
+            __m128i inside = _mm_castps_si128(_mm_and_ps(in0, _mm_and_ps(in1, in2)));
+            __m128i *p = (__m128i*)(row + x);
+            __m128i old = _mm_loadu_si128(p);
+            _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(inside, color), _mm_andnot_si128(inside, old)));
+        }
+#endif
+        // Same arithmetic as the vector loop, so the result does not depend on alignment
+        for (; x < x1; x++) {
+            float px = x + 0.5f;
+            if (a[0]*px + e0 >= 0 and a[1]*px + e1 >= 0 and a[2]*px + e2 >= 0)
+                row[x] = t.color;
+        }
+    }
+}
+
+/* Draw the edges of a triangle one pixel wide, keeping the pixels inside a tile */
+void softOutline (const SoftTriangle &t, int x0, int y0, int x1, int y1)
+{
+    SoftRaster &r = software;
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        float dx = t.x[j] - t.x[i], dy = t.y[j] - t.y[i];
+        int steps = (int)ceilf(max(fabsf(dx), fabsf(dy)));
+        for (int k = 0; k <= steps; k++) {
+            float f = steps ? (float)k / steps : 0;
+            int x = (int)floorf(t.x[i] + f*dx), y = (int)floorf(t.y[i] + f*dy);
+            if (x >= x0 and x < x1 and y >= y0 and y < y1)
+                r.pixels[y*r.width + x] = t.color;
+        }
+    }
+}
+
+void softRasterTile (int tile)
+{
+    SoftRaster &r = software;
+    int x0 = tile % r.tiles_x * SOFT_TILE, y0 = tile / r.tiles_x * SOFT_TILE;
+    int x1 = min(x0 + SOFT_TILE, r.width), y1 = min(y0 + SOFT_TILE, r.height);
+    for (int y = y0; y < y1; y++)
+        std::fill(&r.pixels[y*r.width + x0], &r.pixels[y*r.width + x1], SOFT_CLEAR);
+    const std::vector<int> &bin = r.bins[tile];
+    for (size_t i = 0; i < bin.size(); i++) {
+        const SoftTriangle &t = r.triangles[bin[i]];
+        if (t.outline)
+            softOutline(t, x0, y0, x1, y1);
+        else
+            softFill(t, x0, y0, x1, y1);
+    }
+}
+
+/* Take tiles until there are none left; the workers and the renderer share them */
+void softRasterTiles ()
+{
+    SoftRaster &r = software;
+    int tiles = r.tiles_x * r.tiles_y;
+    for (int tile; (tile = r.next_tile++) < tiles; )
+        softRasterTile(tile);
+}
+
+void softWorker ()
+{
+    SoftRaster &r = software;
+    int seen = 0;
+    std::unique_lock<std::mutex> guard(r.lock);
+    while (true) {
+        r.changed.wait(guard, [&] { return r.stop or r.generation != seen; });
+        if (r.stop)
+            break;
+        seen = r.generation;
+        guard.unlock();
+        softRasterTiles();
+        guard.lock();
+        if (--r.busy == 0)
+            r.changed.notify_all();
+    }
+}
+
+void resizeSoftware (int width, int height)
+{
+    SoftRaster &r = software;
+    r.width = width;
+    r.height = height;
+    r.tiles_x = (width + SOFT_TILE - 1) / SOFT_TILE;
+    r.tiles_y = (height + SOFT_TILE - 1) / SOFT_TILE;
+    r.pixels.assign(width*height, SOFT_CLEAR);
+    r.bins.assign(r.tiles_x*r.tiles_y, std::vector<int>());
+}
+
+/* Replay a recorded frame on the CPU, in the order renderFrameGL draws it */
+void renderFrameSoftware (const FrameArena &arena)
+{
+    long long lap = profileNow();
+    SoftRaster &r = software;
+    const CommandHeader *first = (const CommandHeader*)arena.base;
+    const CommandHeader *end = (const CommandHeader*)(arena.base + arena.used);
+    const FrameCommand &frame = *(const FrameCommand*)(first + 1);
+
+    if (frame.width != r.width or frame.height != r.height)
+        resizeSoftware(frame.width, frame.height);
+    updateCannonFan();
+    r.triangles.clear();
+    for (size_t i = 0; i < r.bins.size(); i++)
+        r.bins[i].clear();
+
+    // Mirrors, then everything else by layer with the bricks in theirs, then the overlay
+    for (const CommandHeader *cmd = first; cmd < end; cmd = nextCommand(cmd)) {
+        const DrawCommand *draw = (const DrawCommand*)(cmd + 1);
+        if (cmd->type == CMD_DRAW and draw->layer == LAYER_STATIC)
+            softDraw(frame.VP, draw->object, draw->instance);
+    }
+    const int *hud_cmd = NULL;
+    const BricksCommand *bricks = NULL;
+    for (const CommandHeader *cmd = first; cmd < end; cmd = nextCommand(cmd)) {
+        const void *payload = cmd + 1;
+        if (cmd->type == CMD_DRAW) {
+            const DrawCommand *draw = (const DrawCommand*)payload;
+            if (draw->layer != LAYER_STATIC)
+                queueInstance(draw->layer, draw->object, draw->instance);
+        }
+        else if (cmd->type == CMD_BRICKS)
+            bricks = (const BricksCommand*)payload;
+        else if (cmd->type == CMD_HUD)
+            hud_cmd = (const int*)payload;
+    }
+    RenderQueue &q = render_queue;
+    sortRenderQueue();
+    int i = 0;
+    for (; i < q.count and (int)(q.keys[i] >> 24) < LAYER_BRICKS; i++)
+        softDraw(frame.VP, q.vaos[q.items[i]], q.sorted_transforms[i]);
+    if (bricks)
+        applyBrickUpdates(*bricks, frame.fall);
+    if (gpu_bricks.enabled) {
+        // Bricks go where the shader would put them; parked ones are not drawn at all
+        GPUBricks &g = gpu_bricks;
+        for (int b = 0; b < BRICK_SLOTS; b++) {
+            if (g.slots[b].fall[1] == 0)
+                continue;
+            Instance2D instance = g.slots[b].spawn;
+            instance.y = brickShaderY(g.slots[b], frame.fall);
+            softDraw(frame.VP, brickObject(b), instance);
+        }
+        g.dirty_first = BRICK_SLOTS;
+        g.dirty_last = -1;
+    }
+    for (; i < q.count; i++)
+        softDraw(frame.VP, q.vaos[q.items[i]], q.sorted_transforms[i]);
+    q.count = 0;
+    if (hud_cmd)
+        softHUD(hud_cmd);
+    r.triangles_drawn += r.triangles.size();
+    lap = profileLap("bin triangles", lap);
+
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.next_tile = 0;
+        r.busy = r.workers.size();
+        r.generation++;
+    }
+    r.changed.notify_all();
+    softRasterTiles();
+    std::unique_lock<std::mutex> guard(r.lock);
+    r.changed.wait(guard, [&r] { return r.busy == 0; });
+    profileLap("rasterize tiles", lap);
+}
+
+/* The frame is already in memory, there is nothing to show */
+void presentSoftware (GLFWwindow *window)
+{
+}
+
+bool readSoftware (std::vector<unsigned int> &pixels, int &width, int &height)
+{
+    pixels = software.pixels;
+    width = software.width;
+    height = software.height;
+    return true;
+}
+
+/* Start a rasterizer worker for every core but the one replaying frames */
+void initSoftware (int width, int height)
+{
+    SoftRaster &r = software;
+    resizeSoftware(width, height);
+    int cores = std::thread::hardware_concurrency();
+    for (int i = 1; i < cores; i++)
+        r.workers.push_back(std::thread(softWorker));
+    cout << "Software: rendering " << width << "x" << height << " in " << SOFT_TILE << "x" << SOFT_TILE
+         << " tiles on " << r.workers.size() + 1 << " threads" << endl;
+}
+
+/* Write RGBA8 pixels, top row first, as a binary PPM; alpha is dropped */
+bool writePPM (const char *path, const unsigned int *pixels, int width, int height)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(3*width);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned int p = pixels[y*width + x];
+            row[3*x] = p & 0xff;
+            row[3*x + 1] = p >> 8 & 0xff;
+            row[3*x + 2] = p >> 16 & 0xff;
+        }
+        fwrite(&row[0], 1, row.size(), file);
+    }
+    return fclose(file) == 0;
+}
+
+void closeSoftware ()
+{
+    SoftRaster &r = software;
+    if (!r.enabled)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.stop = true;
+    }
+    r.changed.notify_all();
+    for (size_t i = 0; i < r.workers.size(); i++)
+        r.workers[i].join();
+    cout << "Software: " << r.triangles_drawn << " triangles rasterized" << endl;
+    if (writePPM(SOFTWARE_FRAME_FILE, &r.pixels[0], r.width, r.height))
+        cout << "Software: last frame written to " SOFTWARE_FRAME_FILE << endl;
+}
+
+/*****************
+ * Null renderer *
+ *****************/
+
+/* With --null, recorded frames are counted and dropped. Nothing is drawn and
+   no driver is loaded, so the frame times left are the game's own: tick,
+   transforms, culling and recording, plus the render queue's sort and batch
+   merge, which are run as renderFrameGL runs them and thrown away. The
+   batching time is also reported on its own. */
+struct NullRenderer {
+    bool enabled;
+    long long frames, commands, draws, brick_updates, hud_vertices;
+    long long bytes;     // arena space the frames took
+    long long batches, batch_ns;
+} null_renderer;
+
+/* Count what the frame submits, by command type, and batch its draws */
+void renderFrameNull (const FrameArena &arena)
+{
+    NullRenderer &n = null_renderer;
+    RenderQueue &q = render_queue;
+    const CommandHeader *end = (const CommandHeader*)(arena.base + arena.used);
+    for (const CommandHeader *cmd = (const CommandHeader*)arena.base; cmd < end; cmd = nextCommand(cmd)) {
+        n.commands++;
+        if (cmd->type == CMD_DRAW)
+            n.draws++;
+        else if (cmd->type == CMD_BRICKS)
+            n.brick_updates += ((const BricksCommand*)(cmd + 1))->count;
+        else if (cmd->type == CMD_HUD)
+            n.hud_vertices += *(const int*)(cmd + 1);
+    }
+
+    // The static layers are cached by the GL backend, so like it batch the rest only
+    long long lap = profileNow();
+    for (const CommandHeader *cmd = (const CommandHeader*)arena.base; cmd < end; cmd = nextCommand(cmd)) {
+        const DrawCommand *draw = (const DrawCommand*)(cmd + 1);
+        if (cmd->type == CMD_DRAW and draw->layer != LAYER_STATIC)
+            queueInstance(draw->layer, draw->object, draw->instance);
+    }
+    sortRenderQueue();
+    for (int first = 0, last; first < q.count; first = last) {
+        for (last = first + 1; last < q.count and q.keys[last] == q.keys[first]; last++)
+            ;
+        n.batches++;
+    }
+    q.count = 0;
+    n.batch_ns += profileLap("batch", lap) - lap;
+
+    n.bytes += arena.used;
+    n.frames++;
+}
+
+void presentNull (GLFWwindow *window)
+{
+}
+
+bool readNull (std::vector<unsigned int> &pixels, int &width, int &height)
+{
+    return false;
+}
+
+void closeNullRenderer ()
+{
+    NullRenderer &n = null_renderer;
+    if (!n.enabled or n.frames == 0)
+        return;
+    cout << "Null renderer: " << n.frames << " frames, " << n.commands << " commands (" << n.draws << " draws, "
+         << n.brick_updates << " brick slot updates, " << n.hud_vertices << " overlay vertices), "
+         << n.bytes / n.frames << " bytes per frame" << endl;
+    printf("  render queue: %.1f batches per frame, sorted and merged in %.1f us per frame\n",
+           (double)n.batches / n.frames, n.batch_ns * 1e-3 / n.frames);
+}
+
+/*****************
+ * Golden images *
+ *****************/
+
+/* --golden-record dir and --golden-check dir turn an offscreen run (--headless
+   or --software) into a visual regression test. The bricks come from a fixed
+   seed and a short script presses keys at set frames, so every run shows the
+   same pictures. Every GOLDEN_INTERVAL frames, the frame is read back and
+   stored as dir/frame_NNNN.ppm, or compared with it: a pixel fails if any
+   channel is off by more than the tolerance, and a failing frame is written
+   as dir/frame_NNNN_diff.ppm with the failed pixels in red over a faded copy
+   of the reference. The render time of every frame goes to dir/timings.csv. */
+#define GOLDEN_INTERVAL 60
+#define GOLDEN_TOLERANCE 8
+
+struct GoldenKey {
+    int frame, key, action;
+};
+
+/* Cannon, laser and speed moves: taps, pressed and released within a frame,
+   and two holds. Nothing fires: the laser cooldown reads the wall clock */
+const GoldenKey golden_script[] = {
+    { 30, GLFW_KEY_A, GLFW_PRESS }, { 30, GLFW_KEY_A, GLFW_RELEASE },
+    { 50, GLFW_KEY_A, GLFW_PRESS }, { 50, GLFW_KEY_A, GLFW_RELEASE },
+    { 70, GLFW_KEY_W, GLFW_PRESS }, { 70, GLFW_KEY_W, GLFW_RELEASE },
+    { 90, GLFW_KEY_M, GLFW_PRESS }, { 90, GLFW_KEY_M, GLFW_RELEASE },
+    { 100, GLFW_KEY_W, GLFW_PRESS }, { 112, GLFW_KEY_W, GLFW_RELEASE },
+    { 130, GLFW_KEY_D, GLFW_PRESS }, { 130, GLFW_KEY_D, GLFW_RELEASE },
+    { 140, GLFW_KEY_D, GLFW_PRESS }, { 140, GLFW_KEY_D, GLFW_RELEASE },
+    { 150, GLFW_KEY_D, GLFW_PRESS }, { 150, GLFW_KEY_D, GLFW_RELEASE },
+    { 170, GLFW_KEY_S, GLFW_PRESS }, { 170, GLFW_KEY_S, GLFW_RELEASE },
+    { 200, GLFW_KEY_M, GLFW_PRESS }, { 200, GLFW_KEY_M, GLFW_RELEASE },
+    { 210, GLFW_KEY_D, GLFW_PRESS }, { 230, GLFW_KEY_D, GLFW_RELEASE },
+    { 250, GLFW_KEY_N, GLFW_PRESS }, { 250, GLFW_KEY_N, GLFW_RELEASE },
+    { 280, GLFW_KEY_A, GLFW_PRESS }, { 280, GLFW_KEY_A, GLFW_RELEASE },
+};
+
+struct Golden {
+    bool enabled, record;
+    const char *dir;
+    int tolerance;
+    int frame;                         // frames rendered so far
+    int compared, failed;
+    double render_total, render_max;   // ms
+    FILE *timings;
+    std::vector<unsigned int> pixels, reference;
+} golden = { false, false, NULL, GOLDEN_TOLERANCE };
+
+/* Read a binary PPM written by writePPM() */
+bool readPPM (const char *path, std::vector<unsigned int> &pixels, int &width, int &height)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+    int max_value = 0;
+    bool ok = fscanf(file, "P6 %d %d %d", &width, &height, &max_value) == 3 and max_value == 255 and fgetc(file) != EOF;
+    std::vector<unsigned char> row(3*max(width, 0));
+    pixels.resize(ok ? width*height : 0);
+    for (int y = 0; ok and y < height; y++) {
+        ok = fread(&row[0], 1, row.size(), file) == row.size();
+        for (int x = 0; ok and x < width; x++)
+            pixels[y*width + x] = row[3*x] | row[3*x + 1] << 8 | row[3*x + 2] << 16 | 0xffu << 24;
+    }
+    fclose(file);
+    return ok;
+}
+
+bool openGolden ()
+{
+    Golden &g = golden;
+    if (g.record)
+        mkdir(g.dir, 0755); // fine if it exists
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/timings.csv", g.dir);
+    g.timings = fopen(path, "w");
+    if (!g.timings) {
+        cout << "Golden: cannot write to " << g.dir << endl;
+        return false;
+    }
+    fprintf(g.timings, "frame,render_ms\n");
+    return true;
+}
+
+/* Time the frame just rendered, and store or compare it if it is a golden one */
+void goldenFrame (const RenderBackend &backend, double render_ms)
+{
+    Golden &g = golden;
+    int frame = ++g.frame;
+    fprintf(g.timings, "%d,%.3f\n", frame, render_ms);
+    g.render_total += render_ms;
+    g.render_max = max(g.render_max, render_ms);
+
+    int width, height;
+    if (frame % GOLDEN_INTERVAL != 0 or !backend.read(g.pixels, width, height))
+        return;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/frame_%04d.ppm", g.dir, frame);
+    g.compared++;
+    if (g.record) {
+        if (!writePPM(path, &g.pixels[0], width, height)) {
+            cout << "Golden: cannot write " << path << endl;
+            g.failed++;
+        }
+        return;
+    }
+
+    int ref_width, ref_height;
+    if (!readPPM(path, g.reference, ref_width, ref_height) or ref_width != width or ref_height != height) {
+        cout << "Golden: frame " << frame << " FAILED, no " << width << "x" << height << " reference at " << path << endl;
+        g.failed++;
+        return;
+    }
+    int failed_pixels = 0, worst = 0;
+    for (size_t i = 0; i < g.pixels.size(); i++) {
+        unsigned int p = g.pixels[i], q = g.reference[i];
+        int diff = 0;
+        for (int shift = 0; shift < 24; shift += 8) // alpha is not compared
+            diff = max(diff, abs((int)(p >> shift & 0xff) - (int)(q >> shift & 0xff)));
+        worst = max(worst, diff);
+        if (diff > g.tolerance) {
+            failed_pixels++;
+            g.pixels[i] = 0xff0000ffu;
+        }
+        else
+            g.pixels[i] = 0xffc0c0c0u + (q >> 2 & 0x3f3f3fu);
+    }
+    cout << "Golden: frame " << frame << (failed_pixels ? " FAILED, " : " ok, ") << failed_pixels << " pixels off by more than "
+         << g.tolerance << " (worst " << worst << "), rendered in " << render_ms << " ms" << endl;
+    if (failed_pixels) {
+        g.failed++;
+        snprintf(path, sizeof(path), "%s/frame_%04d_diff.ppm", g.dir, frame);
+        writePPM(path, &g.pixels[0], width, height);
+    }
+}
+
+/* Summary of the run; false if any frame failed */
+bool closeGolden ()
+{
+    Golden &g = golden;
+    if (!g.enabled)
+        return true;
+    fclose(g.timings);
+    cout << "Golden: " << g.frame << " frames rendered, " << (g.frame ? g.render_total / g.frame : 0)
+         << " ms mean, " << g.render_max << " ms max" << endl;
+    if (g.record)
+        cout << "Golden: " << g.compared - g.failed << " reference frames written to " << g.dir << endl;
+    else
+        cout << "Golden: " << g.failed << " of " << g.compared << " frames failed" << endl;
+    return g.failed == 0;
+}
+
+/****************
+ * Frame pacing *
+ ****************/
+
+/* How the main loop is paced, picked with --pacing:
+     vsync     the swap waits for the display's vertical blank (the default)
+     uncapped  nothing waits
+     adaptive  vsync, but a late frame is shown at once instead of a whole
+               refresh later; needs *_swap_control_tear, else it is vsync
+     fps:N     no vsync: the loop waits for the next 1/N s deadline itself,
+               sleeping until PACING_SPIN_MS before it and spinning the rest,
+               since sleeps can overshoot by a millisecond or more
+   Whatever the mode, the time between frame starts is recorded, and its
+   spread is reported at exit as the frame time jitter. */
+#define PACING_SPIN_MS 1.5
+
+enum PacingMode { PACING_VSYNC, PACING_UNCAPPED, PACING_ADAPTIVE, PACING_LIMITER };
+
+const char *pacing_names[] = { "vsync", "uncapped", "adaptive vsync", "limiter" };
+
+struct Pacing {
+    PacingMode mode;
+    double period;                 // seconds per frame, with the limiter
+    double deadline;               // when the next frame starts, with the limiter
+    double last_start;
+    std::vector<float> intervals;  // ms between frame starts
+    double slept, spun;            // seconds the limiter waited each way
+} pacing;
+
+bool parsePacing (const char *mode)
+{
+    Pacing &p = pacing;
+    if (!strcmp(mode, "vsync"))
+        p.mode = PACING_VSYNC;
+    else if (!strcmp(mode, "uncapped"))
+        p.mode = PACING_UNCAPPED;
+    else if (!strcmp(mode, "adaptive"))
+        p.mode = PACING_ADAPTIVE;
+    else if (!strncmp(mode, "fps:", 4) and atof(mode + 4) > 0) {
+        p.mode = PACING_LIMITER;
+        p.period = 1 / atof(mode + 4);
+    }
+    else
+        return false;
+    return true;
+}
+
+/* Swap interval for the mode; the window's context must be current */
+void applySwapInterval ()
+{
+    int interval = 1;
+    if (pacing.mode == PACING_UNCAPPED or pacing.mode == PACING_LIMITER)
+        interval = 0;
+    else if (pacing.mode == PACING_ADAPTIVE) {
+        if (glfwExtensionSupported("WGL_EXT_swap_control_tear") or glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+            interval = -1;
+        else
+            cout << "Pacing: no adaptive vsync here, using plain vsync" << endl;
+    }
+    glfwSwapInterval(interval);
+}
+
+/* Record the interval since the last frame started */
+void pacingFrameStart ()
+{
+    Pacing &p = pacing;
+    double now = hiresTime();
+    if (p.last_start > 0) {
+        float ms = (now - p.last_start) * 1000;
+        p.intervals.push_back(ms);
+        profileCounter("frame interval us", ms * 1000);
+    }
+    p.last_start = now;
+}
+
+/* With the limiter, wait for the next frame's deadline */
+void pacingWait ()
+{
+    Pacing &p = pacing;
+    if (p.mode != PACING_LIMITER)
+        return;
+    PROFILE_SCOPE("frame limiter");
+    double now = hiresTime();
+    p.deadline = p.deadline == 0 ? now + p.period : p.deadline + p.period;
+    if (p.deadline <= now) {
+        // Late: start right away, and count the next deadlines from here
+        p.deadline = now;
+        return;
+    }
+    double sleep = p.deadline - now - PACING_SPIN_MS * 1e-3;
+    if (sleep > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(sleep));
+        double woke = hiresTime();
+        p.slept += woke - now;
+        now = woke;
+    }
+    double spin_start = now;
+    while (now < p.deadline)
+        now = hiresTime();
+    p.spun += now - spin_start;
+}
+
+void pacingReport ()
+{
+    Pacing &p = pacing;
+    int n = p.intervals.size();
+    if (n == 0)
+        return;
+    double mean = 0, variance = 0;
+    for (int i = 0; i < n; i++)
+        mean += p.intervals[i];
+    mean /= n;
+    std::vector<float> deviations(n);
+    for (int i = 0; i < n; i++) {
+        variance += (p.intervals[i] - mean) * (p.intervals[i] - mean);
+        deviations[i] = fabs(p.intervals[i] - mean);
+    }
+    std::sort(deviations.begin(), deviations.end());
+    printf("Pacing: %s", pacing_names[p.mode]);
+    if (p.mode == PACING_LIMITER)
+        printf(" at %.1f fps (%.0f ms slept, %.0f ms spun)", 1 / p.period, p.slept * 1000, p.spun * 1000);
+    printf(", frame interval %.3f ms mean, jitter %.3f ms stddev, p99 %.3f ms, max %.3f ms off the mean\n",
+           mean, sqrt(variance / n), deviations[n*99/100], deviations[n-1]);
 }
 
-void createbeam()
+/***********************
+ * Late input sampling *
+ ***********************/
+
+/* By default the loop polls input after presenting, so an event waits for
+   the whole next frame before it is simulated. With --late-input the loop
+   instead sleeps after each present until the next vsync is only a predicted
+   frame's work away, and only then polls, ticks and records. The prediction
+   is the longest work of the last LATE_INPUT_WINDOW frames, measured from
+   the frame start to the call to present, plus a margin. A guess that is too
+   low makes the frame miss its vsync, so misses are counted; the input
+   latency histogram shows what the wait buys. */
+#define LATE_INPUT_WINDOW 30
+#define LATE_INPUT_MARGIN_MS 1.0f
+#define LATE_INPUT_DEFAULT_HZ 60  // offscreen, or when the monitor does not say
+
+struct LateInput {
+    bool enabled;
+    double period;                // seconds between vsyncs
+    long long next_vsync;         // profileNow() time, 0 until a frame is presented
+    long long last_presented;
+    float work[LATE_INPUT_WINDOW];// ms, ring of recent frames
+    int frames;
+    double waited;                // seconds slept, total
+    long long misses;             // presents a refresh or more late
+} late_input;
+
+/* Find the refresh period; the mode only makes sense when presents wait for vsync */
+void openLateInput (GLFWwindow *window, bool threaded)
 {
-	// GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    -0.18,-0.06,0, // vertex 1
-    0.18,-0.06,0, // vertex 2
-    0.18, 0.06,0, // vertex 3
+    LateInput &l = late_input;
+    if (pacing.mode == PACING_UNCAPPED or pacing.mode == PACING_LIMITER or threaded) {
+        cout << "Late input: needs vsync pacing and no render thread, turned off" << endl;
+        l.enabled = false;
+        return;
+    }
+    l.period = 1.0 / LATE_INPUT_DEFAULT_HZ;
+    const GLFWvidmode *mode = window ? glfwGetVideoMode(glfwGetPrimaryMonitor()) : NULL;
+    if (mode and mode->refreshRate > 0)
+        l.period = 1.0 / mode->refreshRate;
+}
 
-    0.18, 0.06,0, // vertex 3
-    -0.18, 0.06,0, // vertex 4
-    -0.18,-0.06,0  // vertex 1
-  };
+/* Work a frame is expected to need before its present, in ms */
+float lateInputPrediction ()
+{
+    LateInput &l = late_input;
+    float longest = 0;
+    for (int i = 0; i < min(l.frames, LATE_INPUT_WINDOW); i++)
+        longest = max(longest, l.work[i]);
+    return longest + LATE_INPUT_MARGIN_MS;
+}
 
-  static const GLfloat color_buffer_data [] = {
-    0.35,0.75,1,// color 1
-    0.35,0.75,1, // color 2
-    0.35,0.75,1, // color 3
+/* Sleep until the latest start that still makes the next vsync */
+void lateInputWait ()
+{
+    LateInput &l = late_input;
+    if (!l.enabled or l.next_vsync == 0)
+        return;
+    PROFILE_SCOPE("late input wait");
+    long long start = l.next_vsync - (long long)(lateInputPrediction() * 1e6);
+    long long now = profileNow();
+    if (start > now) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(start - now));
+        l.waited += (profileNow() - now) * 1e-9;
+    }
+}
 
-    0.35,0.75,1, // color 3
-    0.35,0.75,1, // color 4
-    0.35,0.75,1  // color 1
-  };
+/* Learn from the frame just presented: what its work took and when it was shown */
+void lateInputFrameDone (long long frame_start, long long present_start, long long presented)
+{
+    LateInput &l = late_input;
+    long long period = (long long)(l.period * 1e9);
+    l.work[l.frames++ % LATE_INPUT_WINDOW] = (present_start - frame_start) * 1e-6f;
+    if (l.last_presented and presented - l.last_presented > period * 3 / 2)
+        l.misses++;
+    l.last_presented = presented;
+    l.next_vsync = presented + period;
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  beam = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);	
+void lateInputReport ()
+{
+    LateInput &l = late_input;
+    if (!l.enabled or l.frames == 0)
+        return;
+    printf("Late input: %.1f Hz deadlines, %.2f ms predicted work at exit, %.2f ms waited per frame, %lld missed vsyncs\n",
+           1 / l.period, lateInputPrediction(), l.waited * 1000 / l.frames, l.misses);
 }
 
-void createturret()
+/*****************
+ * Render thread *
+ *****************/
+
+/* With --render-thread, a thread of its own owns the GL context, replays each
+   recorded frame and swaps, while the main thread polls input and runs the
+   next tick. Two arenas alternate: the game records into one while the other
+   is replayed, so the game runs at most one frame ahead of the GPU feed. */
+struct RenderStats {
+    GLStats gl;
+    int static_redraws;
+    long long brick_uploads;
+    double stall_time;   // seconds waiting on stream buffer fences, total
+    float gpu_ms[GPU_PASSES]; // GPU time per pass, a few frames old
+    long long present_start, presented; // profileNow() around the last present
+};
+
+struct RenderThread {
+    bool enabled;
+    GLFWwindow *window;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable changed;
+    FrameArena arenas[2];
+    bool in_use[2];      // submitted and not replayed yet
+    int recording;       // arena the game records into
+    int pending;         // arena waiting for the render thread, or -1
+    bool stop;
+    RenderStats stats;   // as of the last replayed frame
+    int viewport_width, viewport_height;
+} render_thread;
+
+/* Make the GL calls for a recorded frame; the only place that draws with GL */
+void renderFrameGL (const FrameArena &arena)
 {
-	// GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    -0.75,-0.09,0, // vertex 1
-    0.75,-0.09,0, // vertex 2
-    0.75, 0.09,0, // vertex 3
+    long long lap = profileNow();
+    RenderThread &rt = render_thread;
+    const CommandHeader *first = (const CommandHeader*)arena.base;
+    const CommandHeader *end = (const CommandHeader*)(arena.base + arena.used);
+    const FrameCommand &frame = *(const FrameCommand*)(first + 1);
+
+    if (frame.width != rt.viewport_width or frame.height != rt.viewport_height) {
+        glViewport(0, 0, (GLsizei) frame.width, (GLsizei) frame.height);
+        resizeStaticLayers(frame.width, frame.height);
+        rt.viewport_width = frame.width;
+        rt.viewport_height = frame.height;
+    }
 
-    0.75, 0.09,0, // vertex 3
-    -0.75, 0.09,0, // vertex 4
-    -0.75,-0.09,0  // vertex 1
-  };
+    beginGPUTimerFrame();
+    // use the loaded shader program
+    useProgram(programID);
+    // VP reaches the shader once per frame through the uniform block. Each object
+    // only queues a 2D transform: its offset and rotation about it
+    updateFrameUniforms(frame.VP, frame.fall);
+    updateCannonFan();
+
+    // The mirrors never move: redraw them only when the cached copy is stale
+    gpuPass(GPU_PASS_STATIC);
+    if (staticLayersStale(frame.VP)) {
+        beginStaticLayers();
+        for (const CommandHeader *cmd = first; cmd < end; cmd = nextCommand(cmd)) {
+            const DrawCommand *draw = (const DrawCommand*)(cmd + 1);
+            if (cmd->type == CMD_DRAW and draw->layer == LAYER_STATIC)
+                queueInstance(draw->layer, draw->object, draw->instance);
+        }
+        flushRenderQueue();
+        endStaticLayers(frame.VP);
+    }
+    compositeStaticLayers();
+    lap = profileLap("static layers", lap);
+
+    const int *hud_cmd = NULL;
+    const BricksCommand *bricks = NULL;
+    for (const CommandHeader *cmd = first; cmd < end; cmd = nextCommand(cmd)) {
+        const void *payload = cmd + 1;
+        if (cmd->type == CMD_DRAW) {
+            const DrawCommand *draw = (const DrawCommand*)payload;
+            if (draw->layer != LAYER_STATIC)
+                queueInstance(draw->layer, draw->object, draw->instance);
+        }
+        else if (cmd->type == CMD_BRICKS)
+            bricks = (const BricksCommand*)payload;
+        else if (cmd->type == CMD_HUD)
+            hud_cmd = (const int*)payload;
+    }
+    lap = profileLap("replay commands", lap);
+
+    // The shader moves the bricks itself; they go where --cpu-bricks queues
+    // them, over the beams and the cannon and under the scenery
+    prepareRenderQueue();
+    drawQueuedLayers(LAYER_BRICKS);
+    if (bricks)
+        applyBrickUpdates(*bricks, frame.fall);
+    if (gpu_bricks.enabled) {
+        gpuPass(GPU_PASS_BRICKS);
+        drawGPUBricks();
+    }
+    drawQueuedLayers(LAYER_COUNT);
+    render_queue.count = 0;
+    lap = profileLap("flush render queue", lap);
+
+    if (hud_cmd) {
+        gpuPass(GPU_PASS_HUD);
+        drawHUD(hud_cmd);
+        profileLap("hud", lap);
+    }
+    endGPUTimerFrame();
 
-  static const GLfloat color_buffer_data [] = {
-    0,0.5,1, // color 1
-    0,0.5,1, // color 2
-    0,0.5,1, // color 3
+    if (capture.enabled)
+        captureFrameGL(frame.width, frame.height);
 
-	0,0.5,1, // color 3
-    0,0.5,1, // color 4
-    0,0.5,1 // color 1
-  };
+    // Fence this frame's streamed data so the next frames write around it
+    advanceStreamBuffer(render_queue.instances);
+    advanceStreamBuffer(hud.stream);
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  turret = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);	
+RenderBackend gl_backend = { "OpenGL", renderFrameGL, presentFrameGL, readFrameGL };
+RenderBackend software_backend = { "software", renderFrameSoftware, presentSoftware, readSoftware };
+RenderBackend null_backend = { "null", renderFrameNull, presentNull, readNull };
+RenderBackend *renderer = &gl_backend;
+
+/* Draw and show a recorded frame, then publish its figures for the game */
+void renderAndPresent (const FrameArena &arena, GLFWwindow *window)
+{
+    RenderThread &rt = render_thread;
+    long long start = profileNow();
+    renderer->render(arena);
+    if (golden.enabled)
+        goldenFrame(*renderer, (profileNow() - start) * 1e-6);
+    long long present_start = profileNow();
+    {
+        PROFILE_SCOPE("present");
+        renderer->present(window);
+    }
+    long long presented = profileNow();
+    measureInputLatency(arena);
+
+    std::lock_guard<std::mutex> guard(rt.lock);
+    rt.stats.gl = gl_stats;
+    rt.stats.static_redraws = static_layers.redraws;
+    rt.stats.brick_uploads = gpu_bricks.uploads;
+    rt.stats.stall_time = render_queue.instances.stall_time + hud.stream.stall_time;
+    memcpy(rt.stats.gpu_ms, gpu_timers.ms, sizeof(rt.stats.gpu_ms));
+    rt.stats.present_start = present_start;
+    rt.stats.presented = presented;
+    memset(&gl_stats, 0, sizeof(gl_stats));
 }
 
-void createmirror()
+/* Body of the render thread: replay whatever the game submits until told to stop */
+void renderLoop ()
 {
-	// GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    -0.7,-0.02,0, // vertex 1
-    0.7,-0.02,0, // vertex 2
-    0.7, 0.02,0, // vertex 3
+    RenderThread &rt = render_thread;
+    profileThread("render");
+    makeContextCurrent(rt.window, true);
+
+    std::unique_lock<std::mutex> guard(rt.lock);
+    while (true) {
+        rt.changed.wait(guard, [&rt] { return rt.stop or rt.pending >= 0; });
+        if (rt.pending < 0)
+            break; // stopping, and nothing left to draw
+        int a = rt.pending;
+        rt.pending = -1;
+        guard.unlock();
+        rt.changed.notify_all();
+
+        renderAndPresent(rt.arenas[a], rt.window);
+
+        guard.lock();
+        rt.in_use[a] = false;
+        rt.changed.notify_all();
+    }
+    drainCapture();
+    makeContextCurrent(rt.window, false);
+}
 
-    0.7, 0.02,0, // vertex 3
-    -0.7, 0.02,0, // vertex 4
-    -0.7,-0.02,0  // vertex 1
-  };
+void startRenderThread (GLFWwindow *window)
+{
+    RenderThread &rt = render_thread;
+    createFrameArena(rt.arenas[0]);
+    createFrameArena(rt.arenas[1]);
+    rt.pending = -1;
+    rt.window = window;
+    if (rt.enabled) {
+        makeContextCurrent(window, false); // the context can only be current on one thread
+        rt.thread = std::thread(renderLoop);
+    }
+}
 
-  static const GLfloat color_buffer_data [] = {
-    0.7,0.7,0.7, // color 1
-    0.7,0.7,0.7, // color 2
-    0.7,0.7,0.7, // color 3
+void stopRenderThread ()
+{
+    RenderThread &rt = render_thread;
+    if (!rt.enabled) {
+        drainCapture(); // the context is current on this thread
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(rt.lock);
+        rt.stop = true;
+    }
+    rt.changed.notify_all();
+    rt.thread.join();
+}
 
-	0.7,0.7,0.7, // color 3
-    0.7,0.7,0.7, // color 4
-    0.7,0.7,0.7 // color 1
-  };
+/* Arena to record the next frame into, once the renderer is done with it */
+FrameArena& beginFrame ()
+{
+    RenderThread &rt = render_thread;
+    if (rt.enabled) {
+        PROFILE_SCOPE("wait for render thread");
+        std::unique_lock<std::mutex> guard(rt.lock);
+        rt.changed.wait(guard, [&rt] { return !rt.in_use[rt.recording]; });
+    }
+    FrameArena &arena = rt.arenas[rt.recording];
+    arena.used = 0;
+    return arena;
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  mirror = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);	
+/* Hand the recorded frame to the render thread, or draw and swap it here */
+void submitFrame ()
+{
+    RenderThread &rt = render_thread;
+    if (!rt.enabled) {
+        renderAndPresent(rt.arenas[rt.recording], rt.window);
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> guard(rt.lock);
+        rt.changed.wait(guard, [&rt] { return rt.pending < 0; });
+        rt.in_use[rt.recording] = true;
+        rt.pending = rt.recording;
+    }
+    rt.changed.notify_all();
+    rt.recording ^= 1;
+}
+
+/* Figures of the last frame the renderer finished */
+RenderStats renderStats ()
+{
+    std::lock_guard<std::mutex> guard(render_thread.lock);
+    return render_thread.stats;
 }
 
 float camera_rotation_angle = 90;
@@ -628,71 +3861,207 @@ void print(int sc, int lives)
 	cout << "\n" << endl;
 }
 
-void draw ()
+/* Bricks currently on screen and beams in flight */
+void countActive (int &bricks, int &beams)
 {
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
-
-  // Eye - Location of camera. Don't change unless you are sure!!
-  //glm::vec3 eye ( 0.0f , 0.0f, 3.0f);
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  //glm::vec3 target (0.0f, 0.0f, -1.0f);
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  //glm::vec3 up (0.0f, 1.0f, 0.0f);
-
-  // Compute Camera matrix (view)
-  Matrices.view = glm::lookAt( eye , eye + target, up ); // Rotating Camera for 3D
-  //  Don't change unless you are sure!!
-  //Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
+  bricks = beams = 0;
+  for (int i = 0; i <= 1000; i++)
+  {
+  	if (tr_y[i] > -4.3 and tr_y[i] < 4.3) bricks++;
+  	if (i <= 500 and rb_y[i] > -4.3 and rb_y[i] < 4.3) bricks++;
+  	if (i <= 500 and gb_y[i] > -4.3 and gb_y[i] < 4.3) bricks++;
+  }
+  for (int lno = 0; lno < 10; lno++)
+  	if (firestatus[lno]) beams++;
+}
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
+/* The simulation runs in fixed steps of TICK_SECONDS: each frame the main
+   loop runs as many ticks as the time since the last frame covers, so bricks,
+   beams, the level and the cannon move at the same speed whatever the pacing
+   mode and frame rate. Offscreen runs take exactly one tick a frame. */
+#define TICK_SECONDS (1.0/60)
+#define TICK_MAX_SECONDS 0.25    // a longer stall is not caught up
+
+/* Keys held down, kept up to date by applyKey() from press and release
+   events. A press moves the cannon or a bucket by the same step a key press
+   always did, as soon as the tick sees it, so a tap can never be lost. While
+   the key stays down it keeps moving a step every tick, so it goes at the
+   same speed whatever the frame rate and whatever the desktop's key-repeat
+   delay. Held movement stops at the furthest positions the press steps could
+   reach. */
+#define HELD_LASER_STEP 0.05f    // laser height per tick, 3 units/s
+#define HELD_AIM_STEP 1.5f       // laser angle per tick in degrees, 90 degrees/s
+#define HELD_BUCKET_STEP 0.025f  // bucket offset per tick, 1.5 units/s
+#define LASER_Y_MIN -3.0f        // 0.5 steps down from 0 while above -2.8
+#define LASER_Y_MAX 3.5f         // 0.5 steps up from 0 while below 3.0
+#define BUCKET_X_MAX 2.05f       // 0.05 steps while within 2
+
+bool keys_held[GLFW_KEY_LAST + 1];
+
+/* A key event from the queue */
+void applyKey (const InputEvent &e)
+{
+  int key = e.code, action = e.action;
+  if (action != GLFW_RELEASE)
+  	stampInput(e.time);
+
+  // Key repeats are ignored for movement: tick() moves held keys at its own rate
+  if (key >= 0 and key <= GLFW_KEY_LAST and action != GLFW_REPEAT)
+  	keys_held[key] = action == GLFW_PRESS;
+
+  if (action == GLFW_PRESS) {
+  	switch (key) {
+  		case GLFW_KEY_RIGHT:
+  			if(red_x < 2 && keys_held[GLFW_KEY_RIGHT_CONTROL]) red_x += 0.05;
+  			if(green_x < 2 && keys_held[GLFW_KEY_RIGHT_ALT]) green_x += 0.05;
+  			break;
+  		case GLFW_KEY_LEFT:
+  			if(red_x > -2 && keys_held[GLFW_KEY_RIGHT_CONTROL]) red_x -= 0.05;
+  			if(green_x > -2 && keys_held[GLFW_KEY_RIGHT_ALT]) green_x -= 0.05;
+  			break;
+  		case GLFW_KEY_A:
+  			if(laserangle < 45) laserangle += 9;
+  			break;
+  		case GLFW_KEY_D:
+  			if(laserangle > -45) laserangle -= 9;
+  			break;
+  		case GLFW_KEY_W:
+  			if(lasery < 3.0) lasery+=0.5;
+  			break;
+  		case GLFW_KEY_S:
+  			if(lasery > -2.8) lasery-=0.5;
+  			break;
+  		default:
+  			break;
+  	}
+  }
 
-  // Load identity to model matrix
+  if (action == GLFW_REPEAT or action == GLFW_PRESS) {
+  	switch (key) {
+  		case GLFW_KEY_M:
+  			if(speed < 10) speed += 1;
+  			break;
+  		case GLFW_KEY_N:
+  			if(speed > 1) speed -= 1;
+  			break;
+  		case GLFW_KEY_SPACE:
+  			if(chargestatus == true && glfwGetTime() - mytime >=1.0)
+  				{
+  					firestatus[currlaser] = true;
+  					currlaser++;
+  					if (currlaser == 10) currlaser = 0;
+  					mytime = glfwGetTime();
+  				}
+  			break;
+  		default:
+  			break;
+  	}
+  }
+  GLfloat cameraSpeed = 0.05f;
+  if(key == GLFW_KEY_8)
+  	eye += cameraSpeed * target;
+  if(key == GLFW_KEY_2)
+  	eye -= cameraSpeed * target;
+  if(key == GLFW_KEY_4)
+  	eye -= glm::normalize(glm::cross(target, up)) * cameraSpeed;
+  if(key == GLFW_KEY_6)
+  	eye += glm::normalize(glm::cross(target, up)) * cameraSpeed;
+}
 
-  Matrices.model = glm::mat4(1.0f);
+/* A mouse click on the cannon moves it up (left button) or down (right button) */
+void applyButton (const InputEvent &e)
+{
+  if (e.action != GLFW_PRESS)
+  	return;
+  stampInput(e.time);
+  switch (e.code)
+  {
+  	case GLFW_MOUSE_BUTTON_LEFT:
+  		if (xpos > 0 and xpos < 100 and ypos > fabs(lasery + 0.5 - 4) * 100 and ypos < fabs(lasery - 0.5 - 4)*100 and lasery < 3.0)lasery += 0.2;
+  		break;
+  	case GLFW_MOUSE_BUTTON_RIGHT:
+  		if (xpos > 0 and xpos < 100 and ypos > fabs(lasery + 0.5 - 4) * 100 and ypos < fabs(lasery - 0.5 - 4)*100 and lasery > -2.8)lasery -= 0.2;
+  		break;
+  	default:
+  		break;
+  }
+}
 
-  glm::mat4 translatemirror = glm::translate (glm::vec3(3.4f, 2.4f, 0.0f));        // glTranslatef
-  glm::mat4 rotatemirror = glm::rotate((float)(135*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatemirror * rotatemirror);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Scrolling over the cannon turns it, scrolling over a bucket slides it */
+void applyScroll (const InputEvent &e)
+{
+  double yoffset = e.y;
+  stampInput(e.time);
+  if(yoffset > 0 and laserangle < 45 and xpos > 0 and xpos < 100 and ypos > (fabs(lasery + 0.5 - 4) * 100) and ypos < fabs(lasery - 0.5 - 4)*100)
+  {
+  	laserangle += 9;
+  }
+  else if(yoffset < 0 and laserangle > -45 and xpos > 0 and xpos < 100 and ypos > fabs(lasery + 0.5 - 4) * 100 and ypos < fabs(lasery - 0.5 - 4)*100)
+  {
+  	laserangle -= 9;
+  }
+  else if(yoffset < 0 and red_x > -2 and xpos < fabs(red_x + 4)*100 + 38 and xpos > fabs(red_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)red_x -= 0.05;
+  else if(yoffset < 0 and green_x > -2 and xpos < fabs(green_x + 4)*100 + 38 and xpos > fabs(green_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)green_x -= 0.05;
+  else if(yoffset > 0 and red_x < 2 and xpos < fabs(red_x + 4)*100 + 38 and xpos > fabs(red_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)red_x += 0.05;
+  else if(yoffset > 0 and green_x < 2 and xpos < fabs(green_x + 4)*100 + 38 and xpos > fabs(green_x + 4)*100 - 38 and ypos > (3.278 + 4)*100 - 32 and ypos < (3.278 + 4)*100 + 32)green_x += 0.05;
+}
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(mirror);
+/* Apply every input event queued since the last tick, oldest first. Cursor
+   moves are applied in order too, so a click or scroll is tested against
+   where the pointer was when it happened */
+void drainInput ()
+{
+  InputEvent e;
+  while (popInput(e)) {
+  	switch (e.type) {
+  		case INPUT_KEY:
+  			applyKey(e);
+  			break;
+  		case INPUT_BUTTON:
+  			applyButton(e);
+  			break;
+  		case INPUT_SCROLL:
+  			applyScroll(e);
+  			break;
+  		case INPUT_CURSOR:
+  			xpos = e.x;
+  			ypos = e.y;
+  			break;
+  	}
+  }
+}
 
-  Matrices.model = glm::mat4(1.0f);
+/* Move the cannon and the buckets one step by the keys held */
+void heldKeysStep ()
+{
+  const bool *down = keys_held;
+  if (down[GLFW_KEY_W])
+  	lasery = max(lasery, min(lasery + HELD_LASER_STEP, LASER_Y_MAX));
+  if (down[GLFW_KEY_S])
+  	lasery = min(lasery, max(lasery - HELD_LASER_STEP, LASER_Y_MIN));
+  if (down[GLFW_KEY_A])
+  	laserangle = max(laserangle, min(laserangle + HELD_AIM_STEP, 45.0f));
+  if (down[GLFW_KEY_D])
+  	laserangle = min(laserangle, max(laserangle - HELD_AIM_STEP, -45.0f));
+
+  // Right Ctrl moves the red bucket, right Alt the green one
+  float step = HELD_BUCKET_STEP * (down[GLFW_KEY_RIGHT] - down[GLFW_KEY_LEFT]);
+  if (down[GLFW_KEY_RIGHT_CONTROL] and step != 0)
+  	red_x = step > 0 ? max(red_x, min(red_x + step, BUCKET_X_MAX)) : min(red_x, max(red_x + step, -BUCKET_X_MAX));
+  if (down[GLFW_KEY_RIGHT_ALT] and step != 0)
+  	green_x = step > 0 ? max(green_x, min(green_x + step, BUCKET_X_MAX)) : min(green_x, max(green_x + step, -BUCKET_X_MAX));
+}
 
-  translatemirror = glm::translate (glm::vec3(3.4f, -2.0f, 0.0f));        // glTranslatef
-  rotatemirror = glm::rotate((float)(45*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatemirror * rotatemirror);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+/* Advance the game by TICK_SECONDS: move the beams and bricks and resolve collisions */
+void tick ()
+{
+  long long lap = profileNow();
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(mirror);
+  drainInput();
+  heldKeysStep();
 
   for (int lno = 0; lno < 10; lno ++)
   {
-  	Matrices.model = glm::mat4(1.0f);
-
-  	glm::mat4 translatebeam = glm::translate (glm::vec3(beamx[lno], beamy[lno], beamz[lno]));        // glTranslatef
-  	glm::mat4 rotatebeam = glm::rotate((float)(beamangle[lno]*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translatebeam * rotatebeam);
-  	MVP	 = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  	// draw3DObject draws the VAO given to it using current MVP matrix
   	if(firestatus[lno] == true)
   	{
   		if((beamy[lno] - 0.06 - ((beamx[lno] + 0.18)*tan(45*M_PI/180.0f) + (-2.0 - 3.4*tan(45*M_PI/180.0f))) < 0.01) and (beamx[lno] + 0.18 >= 3.4 - 0.7*cos(45*M_PI/180.0f)) and (beamy[lno] + 0.06 >= -2 - 0.7*sin(45*M_PI/180.0f)))
@@ -716,7 +4085,7 @@ void draw ()
   					beamx[lno] = laserx;
   					beamy[lno] = lasery;
   					firestatus[lno] = false;
-  					tr_y[j] = tr_y[1000] + 5*j;
+  					recycleBrick(tr_y, j, 1000, 5);
   					score += 100;
   					print(score, lives);
   				}
@@ -732,7 +4101,7 @@ void draw ()
   					beamx[lno] = laserx;
   					beamy[lno] = lasery;
   					firestatus[lno] = false;
-  					rb_y[j] = rb_y[500] + 7*j;
+  					recycleBrick(rb_y, j, 500, 7);
   					score -= 10;
   					print(score, lives);
   				}
@@ -744,7 +4113,7 @@ void draw ()
   					beamx[lno] = laserx;
   					beamy[lno] = lasery;
   					firestatus[lno] = false;
-  					gb_y[j] = gb_y[500] + 7*j;
+  					recycleBrick(gb_y, j, 500, 7);
   					score -= 10;
   					print(score, lives);
   				}
@@ -768,53 +4137,15 @@ void draw ()
   		beamy[lno] = lasery;
   		firestatus[lno] = false;
   	}
-  	draw3DObject(beam);
-
-  }
-
-
-  Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translatebeam = glm::translate (glm::vec3(laserx, lasery, laserz));        // glTranslatef
-  glm::mat4 rotatebeam = glm::rotate((float)(laserangle*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatebeam * rotatebeam);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-
-  draw3DObject(turret);
-
-
-
-  for(int j=0; j<300; j++)
-  {
-  	Matrices.model = glm::mat4(1.0f);
-
-  	/* Render your scene */
-
-  	glm::mat4 translateTriangle = glm::translate (glm::vec3(laserx, lasery, laserz)); // glTranslatef
-  	glm::mat4 rotateTriangle = glm::rotate((float)(10*j*M_PI/1800.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
-  	glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
-  	Matrices.model *= triangleTransform; 
-  	MVP = VP * Matrices.model; // MVP = p * V * M
-
-  	//  Don't change unless you are sure!!
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  	// draw3DObject draws the VAO given to it using current MVP matrix
-  	draw3DObject(triangle);
   }
-
-  // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-  // glPopMatrix ();
+  lap = profileLap("beam update", lap);
 
   for (int i = 0; i <= 1000; i++)
   {
 
   	if(tr_y[i] <= -2.7 and ((tr_x[i] >= green_x - 0.38  && tr_x[i] <= green_x + 0.38) || (tr_x[i] >= red_x - 0.38 && tr_x[i] <= red_x + 0.38)))
   	{
-  		tr_y[i] = tr_y[1000] + 5*i;
+  		recycleBrick(tr_y, i, 1000, 5);
   		lives--;
   		cout << "Life Lost :(" << endl;
   		print(score, lives);
@@ -822,129 +4153,125 @@ void draw ()
 
   	if(tr_y[i] <= -3.4)
   	{
-  		tr_y[i] = tr_y[1000] + 5*i;
+  		recycleBrick(tr_y, i, 1000, 5);
   		score -= 10;
   		print(score, lives);
   	}
 
-  	Matrices.model = glm::mat4(1.0f);
-
-  	glm::mat4 translateRectangle = glm::translate (glm::vec3(tr_x[i], tr_y[i], tr_z[i]));        // glTranslatef
-  	glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translateRectangle * rotateRectangle);
-  	MVP = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  	// draw3DObject draws the VAO given to it using current MVP matrix
-  	draw3DObject(rectangle);
-  	tr_y[i] -= 0.015 * speed;
+  	dropBrick(tr_y, i, 0.015 * speed);
   }
+  lap = profileLap("black brick update", lap);
 
   for (int i = 0; i <= 500; i++)
   {
 
   	if(rb_y[i] <= -2.7 and (rb_x[i] >= red_x - 0.38  && rb_x[i] <= red_x + 0.38)) 
   	{
-  		rb_y[i] = rb_y[500] + 7*i;
+  		recycleBrick(rb_y, i, 500, 7);
   		score += 100;
   		print(score, lives);
   	}
   	else if(rb_y[i] <= -2.7 and (rb_x[i] >= green_x - 0.38  && rb_x[i] <= green_x + 0.38))
   	{
-  		rb_y[i] = rb_y[500] + 7*i;
+  		recycleBrick(rb_y, i, 500, 7);
   		score -= 10;
   		print(score, lives);
   	}
 
-	if(rb_y[i] <= -3.4) rb_y[i] = rb_y[500] + 7*i;
-
-  	Matrices.model = glm::mat4(1.0f);
-
-  	glm::mat4 translateRectangle = glm::translate (glm::vec3(rb_x[i], rb_y[i], rb_z[i]));        // glTranslatef
-  	glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translateRectangle * rotateRectangle);
-  	MVP = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+	if(rb_y[i] <= -3.4) recycleBrick(rb_y, i, 500, 7);
 
-  	// draw3DObject draws the VAO given to it using current MVP matrix
-  	draw3DObject(redrectangle);
-  	rb_y[i] -= 0.015 * speed;
+  	dropBrick(rb_y, i, 0.015 * speed);
   }
+  lap = profileLap("red brick update", lap);
 
   for (int i = 0; i <= 500; i++)
   {
 
   	if(gb_y[i] <= -2.7 and (gb_x[i] >= green_x - 0.38  && gb_x[i] <= green_x + 0.38)) 
   	{
-  		gb_y[i] = gb_y[500] + 7*i;
+  		recycleBrick(gb_y, i, 500, 7);
   		score += 100;
   		print(score, lives);
   	}
   	else if(gb_y[i] <= -2.7 and (gb_x[i] >= red_x - 0.38  && gb_x[i] <= red_x + 0.38)) 
   	{
-  		gb_y[i] = gb_y[500] + 7*i;
+  		recycleBrick(gb_y, i, 500, 7);
   		score -= 10;
   		print(score, lives);
   	}
 
-  	if(gb_y[i] <= -3.4) gb_y[i] = gb_y[500] + 7*i;
+  	if(gb_y[i] <= -3.4) recycleBrick(gb_y, i, 500, 7);
 
-  	Matrices.model = glm::mat4(1.0f);
-
-  	glm::mat4 translateRectangle = glm::translate (glm::vec3(gb_x[i], gb_y[i], gb_z[i]));        // glTranslatef
-  	glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translateRectangle * rotateRectangle);
-  	MVP = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  	// draw3DObject draws the VAO given to it using current MVP matrix
-  	draw3DObject(greenrectangle);
-  	gb_y[i] -= 0.015 * speed;
-  }  
-  
-  Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translatefloor = glm::translate (glm::vec3(0.0f, -4.0f, 0.0f));        // glTranslatef
-  glm::mat4 rotatefloor = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatefloor * rotatefloor);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  	dropBrick(gb_y, i, 0.015 * speed);
+  }
+  advanceGPUBricks(0.015 * speed);
+  profileLap("green brick update", lap);
+}
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(barfloor);
+/* Record this frame's objects; the render backend draws them */
+void draw (FrameArena &arena)
+{
+  long long lap = profileNow();
 
-  Matrices.model = glm::mat4(1.0f);
+  // Eye - Location of camera. Don't change unless you are sure!!
+  //glm::vec3 eye ( 0.0f , 0.0f, 3.0f);
+  // Target - Where is the camera looking at.  Don't change unless you are sure!!
+  //glm::vec3 target (0.0f, 0.0f, -1.0f);
+  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+  //glm::vec3 up (0.0f, 1.0f, 0.0f);
 
-  glm::mat4 translatebucket = glm::translate (glm::vec3(red_x, -3.278f, 0.0f));        // glTranslatef
-  glm::mat4 rotatebucket = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatebucket * rotatebucket);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  // Compute Camera matrix (view)
+  Matrices.view = glm::lookAt( eye , eye + target, up ); // Rotating Camera for 3D
+  //  Don't change unless you are sure!!
+  //Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(redbucket);
+  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
+  //  Don't change unless you are sure!!
+  FrameCommand *frame = (FrameCommand*)recordCommand(arena, CMD_FRAME, sizeof(FrameCommand));
+  frame->VP = Matrices.projection * Matrices.view;
+  frame->fall = gpuBricksFall();
+  frame->width = fb_width;
+  frame->height = fb_height;
+  takeInputs(*frame);
+
+  recordDraw(arena, LAYER_STATIC, mirror, 3.4f, 2.4f, 135*M_PI/180.0f);
+  recordDraw(arena, LAYER_STATIC, mirror, 3.4f, -2.0f, 45*M_PI/180.0f);
+  recordDraw(arena, LAYER_FLOOR, barfloor, 0.0f, -4.0f, rectangle_rotation*M_PI/180.0f);
+  recordDraw(arena, LAYER_WALL, barside, -4.3f, 0.0f, rectangle_rotation*M_PI/180.0f);
 
-  Matrices.model = glm::mat4(1.0f);
+  for (int lno = 0; lno < 10; lno ++)
+  	recordDraw(arena, LAYER_BEAMS, beam, beamx[lno], beamy[lno], beamangle[lno]*M_PI/180.0f);
 
-  translatebucket = glm::translate (glm::vec3(green_x, -3.278f, 0.0f));        // glTranslatef
-  rotatebucket = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatebucket * rotatebucket);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  recordDraw(arena, LAYER_TURRET, turret, laserx, lasery, laserangle*M_PI/180.0f);
+  recordDraw(arena, LAYER_FAN, cannonfan, laserx, lasery, 0);
+  lap = profileLap("record objects", lap);
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(greenbucket);
+  if (gpu_bricks.enabled)
+  	recordBricks(arena, rectangle_rotation*M_PI/180.0f);
+  else
+  {
+  	for (int i = 0; i <= 1000; i++)
+  		if (tr_y[i] != LEVEL_PARKED_Y)
+  			recordDraw(arena, LAYER_BRICKS, rectangle, tr_x[i], tr_y[i], rectangle_rotation*M_PI/180.0f);
 
-  Matrices.model = glm::mat4(1.0f);
+  	for (int i = 0; i <= 500; i++)
+  	{
+  		if (rb_y[i] != LEVEL_PARKED_Y)
+  			recordDraw(arena, LAYER_BRICKS, redrectangle, rb_x[i], rb_y[i], rectangle_rotation*M_PI/180.0f);
+  		if (gb_y[i] != LEVEL_PARKED_Y)
+  			recordDraw(arena, LAYER_BRICKS, greenrectangle, gb_x[i], gb_y[i], rectangle_rotation*M_PI/180.0f);
+  	}
+  }
+  lap = profileLap("record bricks", lap);
 
-  glm::mat4 translatewall = glm::translate (glm::vec3(-4.3f, 0.0f, 0.0f));        // glTranslatef
-  glm::mat4 rotatewall = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translatewall * rotatewall);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  recordDraw(arena, LAYER_SCENERY, redbucket, red_x, -3.278f, rectangle_rotation*M_PI/180.0f);
+  recordDraw(arena, LAYER_SCENERY, greenbucket, green_x, -3.278f, rectangle_rotation*M_PI/180.0f);
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(barside);
+  if (hud.visible)
+  {
+  	recordHUD(arena);
+  	profileLap("record hud", lap);
+  }
 
   // Increment angles
   //float increments = 1;
@@ -956,69 +4283,33 @@ void draw ()
 
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-     // Function is called first on GLFW_PRESS.
+    // Keys that steer the game go through the input queue to the next tick
+    pushInput(INPUT_KEY, key, action, 0, 0);
 
-    if (action == GLFW_REPEAT or action == GLFW_PRESS) {
-        switch (key) {
-            case (GLFW_KEY_RIGHT):
-            	if(red_x < 2 && glfwGetKey(window, GLFW_KEY_RIGHT_CONTROL) == GLFW_PRESS) red_x += 0.05;
-            	if(green_x < 2 && glfwGetKey(window, GLFW_KEY_RIGHT_ALT) == GLFW_PRESS) green_x += 0.05;
-                break;
-            case GLFW_KEY_LEFT:
-                if(red_x > -2 && glfwGetKey(window, GLFW_KEY_RIGHT_CONTROL) == GLFW_PRESS) red_x -= 0.05;
-                if(green_x > -2 && glfwGetKey(window, GLFW_KEY_RIGHT_ALT) == GLFW_PRESS) green_x -= 0.05;
-                break;
-            case GLFW_KEY_M:
-            	if(speed < 10) speed += 1;
-            	break;
-            case GLFW_KEY_N:
-            	if(speed > 1) speed -= 1;
-            	break;
-            case GLFW_KEY_A:
-            	if(laserangle < 45) laserangle += 9;
-            	break;
-            case GLFW_KEY_D:
-            	if(laserangle > -45) laserangle -= 9;
-                break;
-            case GLFW_KEY_SPACE:
-            	if(chargestatus == true && glfwGetTime() - mytime >=1.0)
-            		{
-            			firestatus[currlaser] = true;
-            			currlaser++;
-            			if (currlaser == 10) currlaser = 0;
-            			mytime = glfwGetTime();
-            		}
-            	break;
-            case GLFW_KEY_W:
-            	if(lasery < 3.0)
-            		lasery+=0.5;
-            	break;
-            case GLFW_KEY_S:
-            	if(lasery > -2.8)
-            		lasery-=0.5;
-            	break;
-            default:
-                break;
-        }
-    }
-    else if (action == GLFW_PRESS) {
+    // Keys for the program itself take effect at once
+    if (action == GLFW_PRESS) {
         switch (key) {
             case GLFW_KEY_ESCAPE:
                 quit(window);
                 break;
+            case GLFW_KEY_F1:
+                hud.visible = !hud.visible;
+                break;
+            case GLFW_KEY_F12:
+                profileDump(PROFILE_TRACE_FILE);
+                break;
             default:
                 break;
         }
     }
-    GLfloat cameraSpeed = 0.05f;
-    if(key == GLFW_KEY_8)
-        eye += cameraSpeed * target;
-    if(key == GLFW_KEY_2)
-        eye -= cameraSpeed * target;
-    if(key == GLFW_KEY_4)
-        eye -= glm::normalize(glm::cross(target, up)) * cameraSpeed;
-    if(key == GLFW_KEY_6)
-       	eye += glm::normalize(glm::cross(target, up)) * cameraSpeed;  
+}
+
+/* Press and release the golden run's scripted keys for this frame */
+void goldenInput (int frame, GLFWwindow *window)
+{
+    for (size_t i = 0; i < sizeof(golden_script)/sizeof(golden_script[0]); i++)
+        if (golden_script[i].frame == frame)
+            keyboard(window, golden_script[i].key, 0, golden_script[i].action, 0);
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1046,7 +4337,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    applySwapInterval();
 
     /* --- register callbacks with GLFW --- */
 
@@ -1071,13 +4362,10 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
-/* Initialize the OpenGL rendering properties */
-/* Add all the models to be created here */
-void initGL (GLFWwindow* window, int width, int height)
+/* Register the game's meshes; they reach GL with the first flush, if at all */
+void createModels ()
 {
-    /* Objects should be created before any other gl function and shaders */
-	// Create the models
-	createTriangle (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
+	createCannonFan (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
 	createRectangle ();
 	createfloor();
 	createredbucket();
@@ -1088,11 +4376,29 @@ void initGL (GLFWwindow* window, int width, int height)
 	createturret();
 	createmirror();
 	createwall();
+}
+
+/* Initialize the OpenGL rendering properties */
+/* Add all the models to be created here */
+void initGL (GLFWwindow* window, int width, int height)
+{
+	invalidateRenderState();
+	createRenderQueue();
+	createMeshRegistry();
+
+    /* Objects should be created before any other gl function and shaders */
+	// Create the models
+	createModels();
+	createGPUBricks();
+	createHUD();
+	createGPUTimers();
 	
 	// Create and compile our GLSL program from the shaders
 	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Connect the "Frame" uniform block to its binding point
+	glUniformBlockBinding(programID, glGetUniformBlockIndex(programID, "Frame"), FRAME_BLOCK_BINDING);
+	// Transform for VAOs drawn without an instance array (the HUD): no offset, no rotation, scale 1
+	glVertexAttrib4f(INSTANCE_ATTRIB, 0, 0, 0, 1);
 
 	
 	reshapeWindow (window, width, height);
@@ -1114,6 +4420,86 @@ int main (int argc, char** argv)
 {
 	int width = 800;
 	int height = 800;
+	const char *level_path = NULL;
+	unsigned int seed = 1;
+
+	profileInit();
+	profileThread("main");
+
+	for (int a = 1; a < argc; a++)
+	{
+		if (!strcmp(argv[a], "--level") and a+1 < argc)
+			level_path = argv[++a];
+		else if (!strcmp(argv[a], "--make-level") and a+2 < argc)
+			return makeLevel(argv[a+1], atoi(argv[a+2]));
+		else if (!strcmp(argv[a], "--cpu-bricks"))
+			gpu_bricks.enabled = false;
+		else if (!strcmp(argv[a], "--render-thread"))
+			render_thread.enabled = true;
+		else if (!strcmp(argv[a], "--headless") and a+1 < argc)
+		{
+			headless.enabled = true;
+			headless.frames = atoi(argv[++a]);
+		}
+		else if (!strcmp(argv[a], "--software") and a+1 < argc)
+		{
+			software.enabled = true;
+			null_renderer.enabled = false;
+			renderer = &software_backend;
+			headless.frames = atoi(argv[++a]);
+		}
+		else if (!strcmp(argv[a], "--null") and a+1 < argc)
+		{
+			null_renderer.enabled = true;
+			software.enabled = false;
+			renderer = &null_backend;
+			headless.frames = atoi(argv[++a]);
+		}
+		else if (!strcmp(argv[a], "--seed") and a+1 < argc)
+			seed = atoi(argv[++a]);
+		else if ((!strcmp(argv[a], "--golden-record") or !strcmp(argv[a], "--golden-check")) and a+1 < argc)
+		{
+			golden.enabled = true;
+			golden.record = !strcmp(argv[a], "--golden-record");
+			golden.dir = argv[++a];
+		}
+		else if (!strcmp(argv[a], "--golden-tolerance") and a+1 < argc)
+			golden.tolerance = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "--capture") and a+1 < argc)
+		{
+			capture.enabled = true;
+			capture.path = argv[++a];
+		}
+		else if (!strcmp(argv[a], "--pacing") and a+1 < argc and parsePacing(argv[a+1]))
+			a++;
+		else if (!strcmp(argv[a], "--late-input"))
+			late_input.enabled = true;
+		else {
+			cout << "Usage: " << argv[0] << " [--level file] [--make-level file bricks] [--cpu-bricks] [--render-thread] [--headless frames] [--software frames] [--null frames]"
+			        " [--seed n] [--golden-record dir | --golden-check dir] [--golden-tolerance t] [--capture file.y4m | dir]"
+			        " [--pacing vsync | uncapped | adaptive | fps:N] [--late-input]" << endl;
+			return 1;
+		}
+	}
+
+	if (golden.enabled)
+	{
+		if (!headless.enabled and !software.enabled)
+		{
+			cout << "Golden images need an offscreen run: --headless frames or --software frames" << endl;
+			return 1;
+		}
+		if (!openGolden())
+			return 1;
+	}
+
+	if (capture.enabled and renderer != &gl_backend)
+	{
+		cout << "Capture reads back GL frames; it does not work with --software or --null" << endl;
+		return 1;
+	}
+
+	srand(seed);
 
 	rb_y[0] = 3.9;
 	gb_y[0] = 5.9;
@@ -1134,12 +4520,52 @@ int main (int argc, char** argv)
 		}
 	}
 
+	if (level_path)
+	{
+		if (!openLevel(level_path))
+			return 1;
+		// Bricks only come from the level file, start with every slot empty
+		for (int i = 0; i <= 1000; ++i)
+		{
+			tr_y[i] = LEVEL_PARKED_Y;
+			if (i <= 500) rb_y[i] = gb_y[i] = LEVEL_PARKED_Y;
+		}
+	}
+	// The renderer starts with every slot empty
+	markAllBricks();
+
+
+    GLFWwindow* window = NULL;
+    if (renderer == &gl_backend)
+    {
+    	if (headless.enabled)
+    	{
+    		if (!initHeadless(width, height))
+    			return 1;
+    	}
+    	else
+    		window = initGLFW(width, height);
+    	initGL (window, width, height);
+    }
+    else
+    {
+    	// No GL at all: the meshes and the projection are all the other backends need
+    	createModels();
+    	reshapeWindow(window, width, height);
+    	if (software.enabled)
+    		initSoftware(width, height);
+    }
 
-    GLFWwindow* window = initGLFW(width, height);
+    double last_update_time = glfwGetTime(), current_time;
 
-	initGL (window, width, height);
+    // Count only what the frames cost, not the initial mesh uploads
+    memset(&gl_stats, 0, sizeof(gl_stats));
 
-    double last_update_time = glfwGetTime(), current_time;
+    if (capture.enabled)
+    	openCapture();
+    if (late_input.enabled)
+    	openLateInput(window, render_thread.enabled);
+    startRenderThread(window);
 
     /* Draw in loop */
 
@@ -1167,27 +4593,116 @@ int main (int argc, char** argv)
     cout << "\tD ------------------------> Rotates laser clockwise." << endl;
     cout << "\tN ------------------------> Decrease speed of bricks." << endl;
     cout << "\tM ------------------------> Increase speed of bricks." << endl;
+    cout << "\tF1 -----------------------> Toggle performance overlay." << endl;
+    cout << "\tF12 ----------------------> Write profile trace to " PROFILE_TRACE_FILE "." << endl;
     cout << "\tQ ------------------------> Quit Game.\n\n" << endl;
-    cout << "Press number of lives to start the game with:" << endl;
-    cin >> lives;
+    // Nobody to answer without a window: keep the default lives
+    if (window)
+    {
+    	cout << "Press number of lives to start the game with:" << endl;
+    	cin >> lives;
+    }
+
+    long long last_tick = profileNow();
+    // Half a tick in hand keeps a display refreshing at the tick rate at one
+    // tick a frame, instead of flickering between none and two on timing noise
+    double tick_pending = TICK_SECONDS / 2;
+    for (int frame = 1; (window ? !glfwWindowShouldClose(window) : headless.frames-- > 0) and lives != 0; frame++) {
+
+        lateInputWait();
+        long long frame_start = profileNow();
+        pacingFrameStart();
+
+        // Late input polls right before the tick, instead of after the present
+        if (late_input.enabled and window)
+        {
+        	PROFILE_SCOPE("glfwPollEvents");
+        	glfwPollEvents();
+        }
+
+        if (golden.enabled)
+        	goldenInput(frame, window);
+
+        // Game logic, in the fixed ticks due since the last frame. Offscreen runs
+        // take one tick a frame, so they replay the same
+        long long tick_start = profileNow();
+        tick_pending += window ? min((tick_start - last_tick) * 1e-9, TICK_MAX_SECONDS) : TICK_SECONDS;
+        last_tick = tick_start;
+        for (; tick_pending >= TICK_SECONDS; tick_pending -= TICK_SECONDS)
+        {
+        	// Bring in the bricks that are about to scroll into view
+        	if (level.active)
+        	{
+        		PROFILE_SCOPE("level spawn");
+        		levelSpawn();
+        	}
+        	long long lap = profileNow();
+        	tick();
+        	profileRecord("tick", lap, profileNow());
+        	if (level.active)
+        		level.scroll += 0.015 * speed;
+        }
+        long long tick_end = profileNow();
 
-    while (!glfwWindowShouldClose(window) and lives != 0) {
+        // Record the frame, then draw it here or hand it to the render thread
+        {
+        	PROFILE_SCOPE("draw");
+        	draw(beginFrame());
+        	submitFrame();
+        }
 
-        // OpenGL Draw commands
-        draw();
+        if (level.active)
+        {
+        	if (levelComplete())
+        	{
+        		cout << "LEVEL COMPLETE" << endl;
+        		print(score, lives);
+        		break;
+        	}
+        }
 
         if(lives == 0)
         {
         	cout << "GAME OVER" << endl;
-        	quit(window);	
+        	if (window)
+        		quit(window);	
         	//glfwTerminate();
         }
 
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
-
         // Poll for Keyboard and mouse events
-        glfwPollEvents();
+        if (window and !late_input.enabled)
+        {
+        	PROFILE_SCOPE("glfwPollEvents");
+        	glfwPollEvents();
+        }
+
+        long long frame_end = profileNow();
+        profileRecord("frame", frame_start, frame_end);
+        profileFrame((frame_end - frame_start) * 1e-6f);
+        RenderStats rendered = renderStats();
+        if (late_input.enabled)
+        	lateInputFrameDone(frame_start, rendered.present_start, rendered.presented);
+#ifndef NO_GL_STATS
+        profileCounter("draw calls", rendered.gl.draw_calls);
+        profileCounter("binds", rendered.gl.binds);
+        profileCounter("uniform uploads", rendered.gl.uniform_uploads);
+        profileCounter("state changes", rendered.gl.state_changes);
+        profileCounter("bytes uploaded", rendered.gl.bytes_uploaded);
+#endif
+        profileCounter("static layer redraws", rendered.static_redraws);
+        profileCounter("brick slot uploads", rendered.brick_uploads);
+        profileCounter("stream stall us", rendered.stall_time * 1e6);
+        for (int p = 0; p < GPU_PASSES; p++)
+        	profileCounter(gpu_pass_counters[p], rendered.gpu_ms[p] * 1000);
+
+        // What the overlay shows next frame
+        hud.frame_ms = (frame_end - frame_start) * 1e-6f;
+        hud.tick_ms = (tick_end - tick_start) * 1e-6f;
+        hud.gl = rendered.gl;
+        memcpy(hud.gpu_ms, rendered.gpu_ms, sizeof(hud.gpu_ms));
+        hudPushFrame(hud.frame_ms);
+        if (hud.visible)
+        	countActive(hud.bricks, hud.beams);
 
         // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
         current_time = glfwGetTime(); // Time in seconds
@@ -1195,8 +4710,31 @@ int main (int argc, char** argv)
             // do something every 0.5 seconds ..
             last_update_time = current_time;
         }
+
+        pacingWait();
     }
 
+    stopRenderThread();
+    closeCapture();
+    closeLevel();
+    if (render_thread.arenas[0].dropped + render_thread.arenas[1].dropped)
+        cout << "Frame arenas: " << render_thread.arenas[0].dropped + render_thread.arenas[1].dropped << " commands dropped" << endl;
+    cout << "Stream buffers: " << render_queue.instances.stalls << " instance stalls ("
+         << render_queue.instances.stall_time*1000 << " ms), " << hud.stream.stalls << " overlay stalls ("
+         << hud.stream.stall_time*1000 << " ms)" << endl;
+    if (gpu_timers.late)
+        cout << "GPU timers: " << gpu_timers.late << " frames read back too late to use" << endl;
+    profileReport();
+    pacingReport();
+    latencyReport();
+    inputQueueReport();
+    lateInputReport();
+    profileDump(PROFILE_TRACE_FILE);
+    closeHeadless();
+    closeSoftware();
+    closeNullRenderer();
+    bool passed = closeGolden();
     glfwTerminate();
     //exit(EXIT_SUCCESS);
+    return passed ? 0 : 1;
 }